@@ -1,652 +1,671 @@
 #include "binops.h"
+#include "kernels.h"
 #include "vm.h"
 #include <iconv.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// i64
-struct object *handle_i64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
+struct object *binop_alloc(struct vm *vm, val *left, val *right) {
+  size_t scope = gc_scope_open(&vm->gc);
+  gc_protect(&vm->gc, left);
+  gc_protect(&vm->gc, right);
+  struct object *res = vm_alloc(vm, false);
+  gc_scope_close(&vm->gc, scope);
+  return res;
+}
+
+val binop_concat_chars(struct vm *vm, val string, const char *chars,
+                       bool chars_left) {
+  size_t chars_size = strlen(chars);
+  size_t scope = gc_scope_open(&vm->gc);
+  gc_protect(&vm->gc, &string);
   struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_I64;
+  if (str_size(val_as_obj(string)) + chars_size < DEFAULT_STR_ROPE_MIN) {
+    struct object *other = val_as_obj(string);
+    if (chars_left) {
+      str_fill(vm, res, chars, chars_size, str_chars(other), str_size(other));
+    } else {
+      str_fill(vm, res, str_chars(other), str_size(other), chars, chars_size);
+    }
+    gc_scope_close(&vm->gc, scope);
+    return val_from_obj(res);
+  }
+
+  str_fill(vm, res, chars, chars_size, NULL, 0LL);
+  val piece = val_from_obj(res);
+  gc_protect(&vm->gc, &piece);
+  res = vm_alloc(vm, false);
+  if (chars_left) {
+    str_rope(vm, res, piece, string);
+  } else {
+    str_rope(vm, res, string, piece);
+  }
+  gc_scope_close(&vm->gc, scope);
+  return val_from_obj(res);
+}
+
+// i64
+val handle_i64_u64(struct vm *vm, val left, val right, enum bin_op op) {
+  int64_t lhs = val_i64(left);
+  uint64_t rhs = val_u64(right);
+  int64_t res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->i64 = left->i64 + right->u64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->i64 = left->i64 - right->u64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->i64 = left->i64 * right->u64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->i64 = left->i64 / right->u64;
+    res = lhs / rhs;
     break;
   case OP_MOD:
-    res->i64 = left->i64 % right->u64;
+    res = lhs % rhs;
     break;
   case OP_ANDS:
-    res->i64 = left->i64 && right->u64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->i64 = left->i64 || right->u64;
+    res = lhs || rhs;
     break;
   case OP_AND:
-    res->i64 = left->i64 & right->u64;
+    res = lhs & rhs;
     break;
   case OP_OR:
-    res->i64 = left->i64 | right->u64;
+    res = lhs | rhs;
     break;
   case OP_XOR:
-    res->i64 = left->i64 ^ right->u64;
+    res = lhs ^ rhs;
     break;
   case OP_EQ:
-    res->i64 = left->i64 == right->u64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->i64 = left->i64 != right->u64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->i64 = left->i64 < right->u64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->i64 = left->i64 <= right->u64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->i64 = left->i64 > right->u64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->i64 = left->i64 >= right->u64;
+    res = lhs >= rhs;
     break;
   }
-  return res;
+  return vm_i64(vm, res);
 }
 
-struct object *handle_i64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_I64;
+val handle_i64_i64(struct vm *vm, val left, val right, enum bin_op op) {
+  int64_t lhs = val_i64(left);
+  int64_t rhs = val_i64(right);
+  int64_t res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->i64 = left->i64 + right->i64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->i64 = left->i64 - right->i64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->i64 = left->i64 * right->i64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->i64 = left->i64 / right->i64;
+    res = lhs / rhs;
     break;
   case OP_MOD:
-    res->i64 = left->i64 % right->i64;
+    res = lhs % rhs;
     break;
   case OP_ANDS:
-    res->i64 = left->i64 && right->i64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->i64 = left->i64 || right->i64;
+    res = lhs || rhs;
     break;
   case OP_AND:
-    res->i64 = left->i64 & right->i64;
+    res = lhs & rhs;
     break;
   case OP_OR:
-    res->i64 = left->i64 | right->i64;
+    res = lhs | rhs;
     break;
   case OP_XOR:
-    res->i64 = left->i64 ^ right->i64;
+    res = lhs ^ rhs;
     break;
   case OP_EQ:
-    res->i64 = left->i64 == right->i64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->i64 = left->i64 != right->i64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->i64 = left->i64 < right->i64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->i64 = left->i64 <= right->i64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->i64 = left->i64 > right->i64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->i64 = left->i64 >= right->i64;
+    res = lhs >= rhs;
     break;
   }
-  return res;
+  return vm_i64(vm, res);
 }
 
-struct object *handle_i64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_F64;
+val handle_i64_f64(struct vm *vm, val left, val right, enum bin_op op) {
+  int64_t lhs = val_i64(left);
+  double rhs = val_as_f64(right);
+  double res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->f64 = left->i64 + right->f64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->f64 = left->i64 - right->f64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->f64 = left->i64 * right->f64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->f64 = left->i64 / right->f64;
+    res = lhs / rhs;
     break;
   case OP_ANDS:
-    res->f64 = left->i64 && right->f64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->f64 = left->i64 || right->f64;
+    res = lhs || rhs;
     break;
   case OP_EQ:
-    res->f64 = left->i64 == right->f64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->f64 = left->i64 != right->f64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->f64 = left->i64 < right->f64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->f64 = left->i64 <= right->f64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->f64 = left->i64 > right->f64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->f64 = left->i64 >= right->i64;
+    res = lhs >= rhs;
     break;
   default:
-    make_error(res, "undefined operation between i64 and f64");
+    return vm_error(vm, "undefined operation between i64 and f64");
   }
-  return res;
+  return val_from_f64(res);
 }
 
-struct object *handle_i64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_i64_str(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between i64 and f64");
-    return res;
+    return vm_error(vm, "undefined operation between i64 and f64");
   }
 
-  char buffer[64];
-  snprintf(buffer, 64L, "%ld", left->i64);
-  size_t new_size = strlen(buffer) + strlen(right->string);
-  char *new_str = malloc(new_size + 1);
-
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", buffer, right->string);
-
-  res->string = new_str;
-  return res;
+  char buffer[NUM_CHARS_MAX];
+  num_format_i64(buffer, val_i64(left));
+  return binop_concat_chars(vm, right, buffer, true);
 }
 
 // u64
-struct object *handle_u64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_U64;
+val handle_u64_u64(struct vm *vm, val left, val right, enum bin_op op) {
+  uint64_t lhs = val_u64(left);
+  uint64_t rhs = val_u64(right);
+  uint64_t res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->u64 = left->u64 + right->u64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->u64 = left->u64 - right->u64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->u64 = left->u64 * right->u64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->u64 = left->u64 / right->u64;
+    res = lhs / rhs;
     break;
   case OP_MOD:
-    res->u64 = left->u64 % right->u64;
+    res = lhs % rhs;
     break;
   case OP_ANDS:
-    res->u64 = left->u64 && right->u64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->u64 = left->u64 || right->u64;
+    res = lhs || rhs;
     break;
   case OP_AND:
-    res->u64 = left->u64 & right->u64;
+    res = lhs & rhs;
     break;
   case OP_OR:
-    res->u64 = left->u64 | right->u64;
+    res = lhs | rhs;
     break;
   case OP_XOR:
-    res->u64 = left->u64 ^ right->u64;
+    res = lhs ^ rhs;
     break;
   case OP_EQ:
-    res->u64 = left->u64 == right->u64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->u64 = left->u64 != right->u64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->u64 = left->u64 < right->u64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->u64 = left->u64 <= right->u64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->u64 = left->u64 > right->u64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->u64 = left->u64 >= right->u64;
+    res = lhs >= rhs;
     break;
   }
-  return res;
+  return vm_u64(vm, res);
 }
 
-struct object *handle_u64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_I64;
+val handle_u64_i64(struct vm *vm, val left, val right, enum bin_op op) {
+  uint64_t lhs = val_u64(left);
+  int64_t rhs = val_i64(right);
+  uint64_t res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->u64 = left->u64 + right->i64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->u64 = left->u64 - right->i64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->u64 = left->u64 * right->i64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->u64 = left->u64 / right->i64;
+    res = lhs / rhs;
     break;
   case OP_MOD:
-    res->u64 = left->u64 % right->i64;
+    res = lhs % rhs;
     break;
   case OP_ANDS:
-    res->u64 = left->u64 && right->i64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->u64 = left->u64 || right->i64;
+    res = lhs || rhs;
     break;
   case OP_AND:
-    res->u64 = left->u64 & right->i64;
+    res = lhs & rhs;
     break;
   case OP_OR:
-    res->u64 = left->u64 | right->i64;
+    res = lhs | rhs;
     break;
   case OP_XOR:
-    res->u64 = left->u64 ^ right->i64;
+    res = lhs ^ rhs;
     break;
   case OP_EQ:
-    res->u64 = left->u64 == right->i64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->u64 = left->u64 != right->i64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->u64 = left->u64 < right->i64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->u64 = left->u64 <= right->i64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->u64 = left->u64 > right->i64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->u64 = left->u64 >= right->i64;
+    res = lhs >= rhs;
     break;
   }
-  return res;
+  return vm_i64(vm, res);
 }
 
-struct object *handle_u64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_F64;
+val handle_u64_f64(struct vm *vm, val left, val right, enum bin_op op) {
+  uint64_t lhs = val_u64(left);
+  double rhs = val_as_f64(right);
+  double res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->f64 = left->u64 + right->f64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->f64 = left->u64 - right->f64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->f64 = left->u64 * right->f64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->f64 = left->u64 / right->f64;
+    res = lhs / rhs;
     break;
   case OP_ANDS:
-    res->f64 = left->u64 && right->f64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->f64 = left->u64 || right->f64;
+    res = lhs || rhs;
     break;
   case OP_EQ:
-    res->f64 = left->u64 == right->f64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->f64 = left->u64 != right->f64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->f64 = left->u64 < right->f64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->f64 = left->u64 <= right->f64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->f64 = left->u64 > right->f64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->f64 = left->u64 >= right->i64;
+    res = lhs >= rhs;
     break;
   default:
-    make_error(res, "undefined operation between u64 and f64");
+    return vm_error(vm, "undefined operation between u64 and f64");
   }
-  return res;
+  return val_from_f64(res);
 }
 
-struct object *handle_u64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_u64_str(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between u64 and string");
-    return res;
+    return vm_error(vm, "undefined operation between u64 and string");
   }
 
-  char buffer[64];
-  snprintf(buffer, 64L, "%lu", left->u64);
-  size_t new_size = strlen(buffer) + strlen(right->string);
-  char *new_str = malloc(new_size + 1);
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", buffer, right->string);
-
-  res->string = new_str;
-  return res;
+  char buffer[NUM_CHARS_MAX];
+  num_format_u64(buffer, val_u64(left));
+  return binop_concat_chars(vm, right, buffer, true);
 }
 
 // f64
-struct object *handle_f64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_F64;
+val handle_f64_u64(struct vm *vm, val left, val right, enum bin_op op) {
+  double lhs = val_as_f64(left);
+  uint64_t rhs = val_u64(right);
+  double res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->f64 = left->f64 + right->u64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->f64 = left->f64 - right->u64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->f64 = left->f64 * right->u64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->f64 = left->f64 / right->u64;
+    res = lhs / rhs;
     break;
   case OP_ANDS:
-    res->f64 = left->f64 && right->u64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->f64 = left->f64 || right->u64;
+    res = lhs || rhs;
     break;
   case OP_EQ:
-    res->f64 = left->f64 == right->u64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->f64 = left->f64 != right->u64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->f64 = left->f64 < right->u64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->f64 = left->f64 <= right->u64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->f64 = left->f64 > right->u64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->f64 = left->f64 >= right->i64;
+    res = lhs >= rhs;
     break;
   default:
-    make_error(res, "undefined operation between f64 and u64");
+    return vm_error(vm, "undefined operation between f64 and u64");
   }
-  return res;
+  return val_from_f64(res);
 }
 
-struct object *handle_f64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_F64;
+val handle_f64_i64(struct vm *vm, val left, val right, enum bin_op op) {
+  double lhs = val_as_f64(left);
+  int64_t rhs = val_i64(right);
+  double res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->f64 = left->f64 + right->i64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->f64 = left->f64 - right->i64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->f64 = left->f64 * right->i64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->f64 = left->f64 / right->i64;
+    res = lhs / rhs;
     break;
   case OP_ANDS:
-    res->f64 = left->f64 && right->i64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->f64 = left->f64 || right->i64;
+    res = lhs || rhs;
     break;
   case OP_EQ:
-    res->f64 = left->f64 == right->i64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->f64 = left->f64 != right->i64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->f64 = left->f64 < right->i64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->f64 = left->f64 <= right->i64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->f64 = left->f64 > right->i64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->f64 = left->f64 >= right->i64;
+    res = lhs >= rhs;
     break;
   default:
-    make_error(res, "undefined operation between f64 and i64");
+    return vm_error(vm, "undefined operation between f64 and i64");
   }
-  return res;
+  return val_from_f64(res);
 }
 
-struct object *handle_f64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_F64;
+val handle_f64_f64(struct vm *vm, val left, val right, enum bin_op op) {
+  double lhs = val_as_f64(left);
+  double rhs = val_as_f64(right);
+  double res = 0;
 
   switch (op) {
   case OP_ADD:
-    res->f64 = left->f64 + right->f64;
+    res = lhs + rhs;
     break;
   case OP_SUB:
-    res->f64 = left->f64 - right->f64;
+    res = lhs - rhs;
     break;
   case OP_MUL:
-    res->f64 = left->f64 * right->f64;
+    res = lhs * rhs;
     break;
   case OP_DIV:
-    res->f64 = left->f64 / right->f64;
+    res = lhs / rhs;
     break;
   case OP_ANDS:
-    res->f64 = left->f64 && right->f64;
+    res = lhs && rhs;
     break;
   case OP_ORS:
-    res->f64 = left->f64 || right->f64;
+    res = lhs || rhs;
     break;
   case OP_EQ:
-    res->f64 = left->f64 == right->f64;
+    res = lhs == rhs;
     break;
   case OP_NEQ:
-    res->f64 = left->f64 != right->f64;
+    res = lhs != rhs;
     break;
   case OP_LT:
-    res->f64 = left->f64 < right->f64;
+    res = lhs < rhs;
     break;
   case OP_LE:
-    res->f64 = left->f64 <= right->f64;
+    res = lhs <= rhs;
     break;
   case OP_GT:
-    res->f64 = left->f64 > right->f64;
+    res = lhs > rhs;
     break;
   case OP_GE:
-    res->f64 = left->f64 >= right->f64;
+    res = lhs >= rhs;
     break;
   default:
-    make_error(res, "undefined operation between f64 and f64");
+    return vm_error(vm, "undefined operation between f64 and f64");
   }
-  return res;
+  return val_from_f64(res);
 }
 
-struct object *handle_f64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_f64_str(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between f64 and string");
-    return res;
+    return vm_error(vm, "undefined operation between f64 and string");
   }
 
-  char buffer[200];
-  snprintf(buffer, 64L, "%lf", left->f64);
-  size_t new_size = strlen(buffer) + strlen(right->string);
-  char *new_str = malloc(new_size + 1);
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", buffer, right->string);
-
-  res->string = new_str;
-  return res;
+  char buffer[NUM_CHARS_MAX];
+  num_format_f64(buffer, val_as_f64(left));
+  return binop_concat_chars(vm, right, buffer, true);
 }
 
 // string
-struct object *handle_str_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_str_u64(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between string and u64");
-    return res;
+    return vm_error(vm, "undefined operation between string and u64");
   }
 
-  char buffer[200];
-  snprintf(buffer, 64L, "%lu", right->u64);
-  size_t new_size = strlen(buffer) + strlen(left->string);
-  char *new_str = malloc(new_size + 1);
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", left->string, buffer);
-
-  res->string = new_str;
-  return res;
+  char buffer[NUM_CHARS_MAX];
+  num_format_u64(buffer, val_u64(right));
+  return binop_concat_chars(vm, left, buffer, false);
 }
 
-struct object *handle_str_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_str_i64(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between string and i64");
-    return res;
+    return vm_error(vm, "undefined operation between string and i64");
   }
 
-  char buffer[200];
-  snprintf(buffer, 64L, "%ld", right->i64);
-  size_t new_size = strlen(buffer) + strlen(left->string);
-  char *new_str = malloc(new_size + 1);
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", left->string, buffer);
-
-  res->string = new_str;
-  return res;
+  char buffer[NUM_CHARS_MAX];
+  num_format_i64(buffer, val_i64(right));
+  return binop_concat_chars(vm, left, buffer, false);
 }
 
-struct object *handle_str_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  res->type = TYPE_STRING;
-
+val handle_str_f64(struct vm *vm, val left, val right, enum bin_op op) {
   if (op != OP_ADD) {
-    make_error(res, "undefined operation between string and f64");
-    return res;
+    return vm_error(vm, "undefined operation between string and f64");
   }
 
-  char buffer[200];
-  snprintf(buffer, 64L, "%lf", right->f64);
-  size_t new_size = strlen(buffer) + strlen(left->string);
-  char *new_str = malloc(new_size + 1);
+  char buffer[NUM_CHARS_MAX];
+  num_format_f64(buffer, val_as_f64(right));
+  return binop_concat_chars(vm, left, buffer, false);
+}
 
-  memset(new_str, 0L, new_size + 1);
-  sprintf(new_str, "%s%s", left->string, buffer);
+val handle_str_str(struct vm *vm, val left, val right, enum bin_op op) {
+  if (op == OP_EQ) {
+    return val_from_small_i64(
+        str_equals(val_as_obj(left), val_as_obj(right)));
+  } else if (op == OP_NEQ) {
+    return val_from_small_i64(
+        !str_equals(val_as_obj(left), val_as_obj(right)));
+  } else if (op != OP_ADD) {
+    return vm_error(vm, "undefined operation between strings");
+  }
 
-  res->string = new_str;
-  return res;
+  size_t size = str_size(val_as_obj(left)) + str_size(val_as_obj(right));
+  struct object *res = binop_alloc(vm, &left, &right);
+  if (size >= DEFAULT_STR_ROPE_MIN) {
+    str_rope(vm, res, left, right);
+    return val_from_obj(res);
+  }
+
+  struct object *left_string = val_as_obj(left);
+  struct object *right_string = val_as_obj(right);
+  str_fill(vm, res, str_chars(left_string), str_size(left_string),
+           str_chars(right_string), str_size(right_string));
+  return val_from_obj(res);
 }
 
-struct object *handle_str_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op) {
-  struct object *res = vm_alloc(vm, false);
-  if (op == OP_ADD) {
-    res->type = TYPE_STRING;
-    size_t left_size = strlen(left->string);
-    size_t right_size = strlen(right->string);
-    size_t new_size = left_size + right_size + 1;
-    res->string = malloc(new_size);
-    memset(res->string, 0L, new_size);
-    sprintf(res->string, "%s%s", left->string, right->string);
-  } else if (op == OP_EQ) {
-    res->type = TYPE_I64;
-    res->i64 = strcmp(left->string, right->string) == 0;
-  } else if (op == OP_NEQ) {
-    res->type = TYPE_I64;
-    res->i64 = strcmp(left->string, right->string) != 0;
-  } else {
-    make_error(res, "undefined operation between strings");
+// Lists combine item by item, a scalar on either side meets every item.
+// Packed lists go through the kernels, anything else through the handlers
+// with results kept on the vm stack until the list holding them exists.
+val handle_list(struct vm *vm, val left, val right, enum bin_op op) {
+  bool left_list = val_type(left) == TYPE_LIST;
+  bool right_list = val_type(right) == TYPE_LIST;
+  size_t size = val_as_obj(left_list ? left : right)->list.size;
+  if (left_list && right_list && val_as_obj(right)->list.size != size) {
+    return vm_error(vm, "list sizes differ: %lu and %lu", size,
+                    val_as_obj(right)->list.size);
   }
 
-  return res;
+  if (size == 0) {
+    return vm->empty_list;
+  }
+
+  val res = VAL_NULL;
+  if (list_map(vm, left, right, op, &res)) {
+    return res;
+  }
+
+  size_t scope = gc_scope_open(&vm->gc);
+  gc_protect(&vm->gc, &left);
+  gc_protect(&vm->gc, &right);
+  for (size_t li = 0LL; li < size; li++) {
+    size_t item_scope = gc_scope_open(&vm->gc);
+    val left_item = left_list ? list_get(vm, val_as_obj(left), li) : left;
+    gc_protect(&vm->gc, &left_item);
+    val right_item = right_list ? list_get(vm, val_as_obj(right), li) : right;
+    vm_push(vm, handle_bin_op(vm, left_item, right_item, op));
+    gc_scope_close(&vm->gc, item_scope);
+  }
+
+  struct object *list = vm_alloc(vm, false);
+  gc_scope_close(&vm->gc, scope);
+  vm->stack_size -= size;
+  list->type = TYPE_LIST;
+  list->list.size = size;
+  list->list.items = malloc(sizeof(val) * size);
+  memcpy(list->list.items, vm->stack + vm->stack_size, sizeof(val) * size);
+  vm->gc.allocated += sizeof(val) * size;
+  list_pack(vm, list);
+  return val_from_obj(list);
 }
 
-struct object *handle_bin_op(struct vm *vm, struct object *left,
-                             struct object *right, enum bin_op op) {
-  struct object *res;
-  int ltype = left->type;
+val handle_bin_op(struct vm *vm, val left, val right, enum bin_op op) {
+  val res;
+  int ltype = val_type(left);
   if (ltype == TYPE_ERROR) {
     return left;
   }
 
-  int rtype = right->type;
+  int rtype = val_type(right);
   if (rtype == TYPE_ERROR) {
     return right;
   }
 
-  if (ltype == TYPE_U64 && rtype == TYPE_U64) {
+  if (ltype == TYPE_LIST || rtype == TYPE_LIST) {
+    res = handle_list(vm, left, right, op);
+  } else if (ltype == TYPE_U64 && rtype == TYPE_U64) {
     res = handle_u64_u64(vm, left, right, op);
   } else if (ltype == TYPE_U64 && rtype == TYPE_I64) {
     res = handle_u64_i64(vm, left, right, op);
@@ -679,8 +698,7 @@ struct object *handle_bin_op(struct vm *vm, struct object *left,
   } else if (ltype == TYPE_STRING && rtype == TYPE_STRING) {
     res = handle_str_str(vm, left, right, op);
   } else {
-    res = vm_alloc(vm, false);
-    make_error(res, "undefined binary operation");
+    res = vm_error(vm, "undefined binary operation");
   }
 
   return res;
@@ -1,57 +1,52 @@
 #pragma once
 #include "vm.h"
 
+// Allocates the result of an operation, the operands are updated in place if
+// the allocation moves them.
+struct object *binop_alloc(struct vm *vm, val *left, val *right);
+
+// Numbers joined to a string are formatted into chars first, long results
+// get a string of their own for the chars and a rope joining both.
+val binop_concat_chars(struct vm *vm, val string, const char *chars,
+                       bool chars_left);
+
 // i64
-struct object *handle_i64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_i64_u64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_i64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_i64_i64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_i64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_i64_f64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_i64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_i64_str(struct vm *vm, val left, val right, enum bin_op op);
 
 // u64
-struct object *handle_u64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_u64_u64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_u64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_u64_i64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_u64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_u64_f64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_u64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_u64_str(struct vm *vm, val left, val right, enum bin_op op);
 
 // f64
-struct object *handle_f64_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_f64_u64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_f64_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_f64_i64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_f64_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_f64_f64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_f64_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_f64_str(struct vm *vm, val left, val right, enum bin_op op);
 
 // str
-struct object *handle_str_u64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_str_u64(struct vm *vm, val left, val right, enum bin_op op);
+
+val handle_str_i64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_str_i64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_str_f64(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_str_f64(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+val handle_str_str(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_str_str(struct vm *vm, struct object *left,
-                              struct object *right, enum bin_op op);
+// list
+val handle_list(struct vm *vm, val left, val right, enum bin_op op);
 
-struct object *handle_bin_op(struct vm *vm, struct object *left,
-                             struct object *right, enum bin_op op);
+val handle_bin_op(struct vm *vm, val left, val right, enum bin_op op);
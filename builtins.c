@@ -6,185 +6,139 @@
 #include <stdlib.h>
 #include <string.h>
 
-void setup_builtins(struct enclosing *encl) {
-  assert(encl != NULL);
-
-  struct object *print_fun = vm_alloc(encl->vm, true);
-  print_fun->type = TYPE_FUNCTION;
-  print_fun->function =
-      (struct function){.target = TARGET_NATIVE, .native_call = bee_print};
-  enclosing_bind(encl, print_fun, strdup("print"));
-
-  struct object *typename_fun = vm_alloc(encl->vm, true);
-  typename_fun->type = TYPE_FUNCTION;
-  typename_fun->function =
-      (struct function){.target = TARGET_NATIVE, .native_call = bee_typename};
-  enclosing_bind(encl, typename_fun, strdup("typename"));
-
-  struct object *pair_fun = vm_alloc(encl->vm, true);
-  pair_fun->type = TYPE_FUNCTION;
-  pair_fun->function =
-      (struct function){.target = TARGET_NATIVE, .native_call = bee_pair};
-  enclosing_bind(encl, pair_fun, strdup("pair"));
-
-  struct object *head_fun = vm_alloc(encl->vm, true);
-  head_fun->type = TYPE_FUNCTION;
-  head_fun->function =
-      (struct function){.target = TARGET_NATIVE, .native_call = bee_head};
-  enclosing_bind(encl, head_fun, strdup("head"));
-
-  struct object *tail_fun = vm_alloc(encl->vm, true);
-  tail_fun->type = TYPE_FUNCTION;
-  tail_fun->function =
-      (struct function){.target = TARGET_NATIVE, .native_call = bee_tail};
-  enclosing_bind(encl, tail_fun, strdup("tail"));
+void setup_builtins(struct vm *vm) {
+  assert(vm != NULL);
+
+  // typename() hands out the same string object for every type
+  static const char *type_names[] = {
+      [TYPE_UNIT] = "unit",     [TYPE_NIL] = "nil",
+      [TYPE_BOL] = "bol",       [TYPE_U64] = "u64",
+      [TYPE_I64] = "i64",       [TYPE_F64] = "f64",
+      [TYPE_ERROR] = "error",   [TYPE_STRING] = "string",
+      [TYPE_PAIR] = "pair",     [TYPE_LIST] = "list",
+      [TYPE_DICT] = "dict",     [TYPE_FUNCTION] = "function",
+  };
+  for (size_t ti = 0LL; ti <= TYPE_FUNCTION; ti++) {
+    vm->type_names[ti] = val_from_obj(
+        symbol_intern(vm, type_names[ti], strlen(type_names[ti])));
+  }
+
+  setup_native(vm, "print", bee_print);
+  setup_native(vm, "typename", bee_typename);
+  setup_native(vm, "pair", bee_pair);
+  setup_native(vm, "head", bee_head);
+  setup_native(vm, "tail", bee_tail);
+  setup_native(vm, "len", bee_len);
+  setup_native(vm, "parse_number", bee_parse_number);
 }
 
-struct object *bee_print(struct enclosing *encl) {
-  assert(encl != NULL);
-  struct bind *args_bind = enclosing_find(encl, "args");
-  assert(args_bind != NULL);
+void setup_native(struct vm *vm, char *id, native_fun native_call) {
+  struct object *fun = vm_alloc(vm, true);
+  fun->type = TYPE_FUNCTION;
+  fun->function = malloc(sizeof(struct function));
+  vm->gc.allocated += sizeof(struct function);
+  *fun->function =
+      (struct function){.target = TARGET_NATIVE, .native_call = native_call};
+  vm_define_global(vm, id, val_from_obj(fun));
+}
 
-  struct object *args = args_bind->object;
-  assert(args->type == TYPE_LIST);
-  struct list *arg = args->list;
+val bee_print(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
   size_t wbytes = 0LL;
-  while (arg != NULL) {
-    struct object *argv = arg->item;
-    wbytes += object_print(argv, false);
-    if (arg->next != NULL) {
+  for (size_t ai = 0LL; ai < argc; ai++) {
+    wbytes += val_print(argv[ai], false);
+    if (ai + 1 < argc) {
       printf(" ");
     }
-
-    arg = arg->next;
   }
 
   printf("\n");
-  struct object *res = vm_alloc(encl->vm, false);
-  res->type = TYPE_I64;
-  res->i64 = wbytes;
-  return res;
+  return vm_i64(vm, wbytes);
 }
 
-struct object *bee_typename(struct enclosing *encl) {
-  assert(encl != NULL);
-  struct bind *args_bind = enclosing_find(encl, "args");
-  assert(args_bind != NULL);
-
-  struct object *args = args_bind->object;
-  assert(args->type == TYPE_LIST);
-  assert(args->list != NULL);
-  assert(args->list->item != NULL);
-
-  struct object *arg0 = args->list->item;
-  struct object *res = vm_alloc(encl->vm, false);
-  res->type = TYPE_STRING;
-
-  switch (arg0->type) {
-  case TYPE_UNIT:
-    res->string = strdup("unit");
-    break;
-  case TYPE_NIL:
-    res->string = strdup("nil");
-    break;
-  case TYPE_FUNCTION:
-    res->string = strdup("function");
-    break;
-  case TYPE_BOL:
-    res->string = strdup("bol");
-    break;
-  case TYPE_U64:
-    res->string = strdup("u64");
-    break;
-  case TYPE_I64:
-    res->string = strdup("i64");
-    break;
-  case TYPE_F64:
-    res->string = strdup("f64");
-    break;
-  case TYPE_STRING:
-    res->string = strdup("string");
-    break;
-  case TYPE_PAIR:
-    res->string = strdup("pair");
-    break;
-  case TYPE_LIST:
-    res->string = strdup("list");
-    break;
-  case TYPE_DICT:
-    res->string = strdup("dict");
-    break;
-  case TYPE_ERROR:
-    res->string = strdup("error");
-    break;
+val bee_typename(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
+  if (argc < 1) {
+    return vm_error(vm, "typename() takes one argument");
   }
-  return res;
-}
 
-struct object *bee_pair(struct enclosing *encl) {
-  assert(encl != NULL);
+  return vm->type_names[val_type(argv[0])];
+}
 
-  struct bind *args_bind = enclosing_find(encl, "args");
-  assert(args_bind != NULL);
-  struct object *args_obj = args_bind->object;
-  assert(args_obj != NULL);
-  assert(args_obj->type == TYPE_LIST);
+val bee_pair(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
 
-  struct object *res = vm_alloc(encl->vm, false);
+  struct object *res = vm_alloc(vm, false);
   res->type = TYPE_PAIR;
+  res->pair.head = argc > 0 ? argv[0] : VAL_NIL;
+  res->pair.tail = argc > 1 ? argv[1] : VAL_NIL;
+
+  gc_write_barrier(vm, res, res->pair.head);
+  gc_write_barrier(vm, res, res->pair.tail);
+  return val_from_obj(res);
+}
 
-  if (args_obj->list == NULL) {
-    // TODO: make a global nil object
-    struct object *nil = vm_alloc(encl->vm, false);
-    nil->type = TYPE_NIL;
-    res->pair.head = nil;
-    res->pair.tail = nil;
-  } else {
-    struct list *arg0_item = args_obj->list;
-    struct list *arg1_item = arg0_item->next;
-    res->pair.head = arg0_item->item;
-    res->pair.tail = arg1_item->item;
+val bee_head(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
+
+  if (argc < 1 || val_type(argv[0]) != TYPE_PAIR) {
+    return vm_error(vm, "head() takes only one argument and must be a pair");
   }
 
-  return res;
+  return val_as_obj(argv[0])->pair.head;
 }
 
-struct object *bee_head(struct enclosing *encl) {
-  assert(encl != NULL);
-
-  struct bind *args_bind = enclosing_find(encl, "args");
-  assert(args_bind != NULL);
-  struct object *args_obj = args_bind->object;
-  assert(args_obj != NULL);
-  assert(args_obj->type == TYPE_LIST);
-  assert(args_obj->list != NULL);
-  assert(args_obj->list->item != NULL);
-
-  struct object *pair_arg = args_obj->list->item;
-  if (pair_arg->type != TYPE_PAIR) {
-    struct object *error = vm_alloc(encl->vm, false);
-    make_error(error, "head() takes only one argument and must be a pair");
-    return error;
+val bee_tail(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
+
+  if (argc < 1 || val_type(argv[0]) != TYPE_PAIR) {
+    return vm_error(vm, "tail() takes only one argument and must be a pair");
   }
 
-  return pair_arg->pair.head;
+  return val_as_obj(argv[0])->pair.tail;
 }
 
-struct object *bee_tail(struct enclosing *encl) {
-  struct bind *args_bind = enclosing_find(encl, "args");
-  assert(args_bind != NULL);
-  struct object *args_obj = args_bind->object;
-  assert(args_obj != NULL);
-  assert(args_obj->type == TYPE_LIST);
-  assert(args_obj->list != NULL);
-  assert(args_obj->list->item != NULL);
-
-  struct object *pair_arg = args_obj->list->item;
-  if (pair_arg->type != TYPE_PAIR) {
-    struct object *error = vm_alloc(encl->vm, false);
-    make_error(error, "tail() takes only one argument and must be a pair");
-    return error;
+val bee_len(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
+
+  if (argc < 1 || val_type(argv[0]) != TYPE_LIST) {
+    return vm_error(vm, "len() takes only one argument and must be a list");
+  }
+
+  return vm_i64(vm, val_as_obj(argv[0])->list.size);
+}
+
+// The whole string must be one number, leading or trailing spaces included.
+val bee_parse_number(struct vm *vm, val *argv, size_t argc) {
+  assert(vm != NULL);
+
+  if (argc < 1 || val_type(argv[0]) != TYPE_STRING) {
+    return vm_error(vm,
+                    "parse_number() takes only one argument and must be a "
+                    "string");
+  }
+
+  struct object *string = val_as_obj(argv[0]);
+  struct num num;
+  size_t size = num_parse(str_chars(string), str_size(string), &num);
+  if (size != 0 && size == str_size(string)) {
+    switch (num.type) {
+    case NUM_I64:
+      return vm_i64(vm, num.i64);
+    case NUM_U64:
+      return vm_u64(vm, num.u64);
+    case NUM_F64:
+      return val_from_f64(num.f64);
+    case NUM_INVALID:
+      break;
+    }
   }
 
-  return pair_arg->pair.tail;
+  // inline chars move with a young cell once the error is allocated
+  char chars[DEFAULT_VM_ERROR_SIZE];
+  size = str_size(string) < sizeof(chars) ? str_size(string)
+                                          : sizeof(chars) - 1;
+  memcpy(chars, str_chars(string), size);
+  chars[size] = '\0';
+  return vm_error(vm, "invalid number: '%s'", chars);
 }
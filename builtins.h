@@ -1,13 +1,20 @@
 #pragma once
 #include "vm.h"
 
-void setup_builtins(struct enclosing *);
+void setup_builtins(struct vm *);
+void setup_native(struct vm *, char *, native_fun);
 
 // misc stuff
-struct object *bee_print(struct enclosing *);
-struct object *bee_typename(struct enclosing *);
+val bee_print(struct vm *, val *, size_t);
+val bee_typename(struct vm *, val *, size_t);
 
 // pair stuff
-struct object *bee_pair(struct enclosing *);
-struct object *bee_head(struct enclosing *);
-struct object *bee_tail(struct enclosing *);
+val bee_pair(struct vm *, val *, size_t);
+val bee_head(struct vm *, val *, size_t);
+val bee_tail(struct vm *, val *, size_t);
+
+// list stuff
+val bee_len(struct vm *, val *, size_t);
+
+// string stuff
+val bee_parse_number(struct vm *, val *, size_t);
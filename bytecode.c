@@ -0,0 +1,643 @@
+#define _GNU_SOURCE
+#include "bytecode.h"
+#include "ast.h"
+#include "vm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct chunk *chunk_new(struct vm *vm) {
+  assert(vm != NULL);
+  struct chunk *chunk = malloc(sizeof(struct chunk));
+  chunk->code_size = 0LL;
+  chunk->code_cap = DEFAULT_CHUNK_CODE_CAP;
+  chunk->code = malloc(sizeof(uint32_t) * chunk->code_cap);
+  chunk->consts_size = 0LL;
+  chunk->consts_cap = DEFAULT_CHUNK_CONSTS_CAP;
+  chunk->consts = malloc(sizeof(val) * chunk->consts_cap);
+  chunk->nparams = 0LL;
+  chunk->nslots = 0LL;
+
+  // chunks are owned by the vm, functions and closures only borrow them
+  chunk->next = vm->chunks;
+  vm->chunks = chunk;
+  return chunk;
+}
+
+void chunk_free(struct chunk *chunk) {
+  assert(chunk != NULL);
+  free(chunk->code);
+  free(chunk->consts);
+}
+
+size_t chunk_emit(struct chunk *chunk, uint32_t word) {
+  assert(chunk != NULL);
+  if (chunk->code_size == chunk->code_cap) {
+    chunk->code_cap *= 2;
+    chunk->code = realloc(chunk->code, sizeof(uint32_t) * chunk->code_cap);
+  }
+
+  chunk->code[chunk->code_size] = word;
+  return chunk->code_size++;
+}
+
+uint32_t chunk_add_const(struct chunk *chunk, val value) {
+  assert(chunk != NULL);
+  assert(value != VAL_NULL);
+  if (chunk->consts_size == chunk->consts_cap) {
+    chunk->consts_cap *= 2;
+    chunk->consts = realloc(chunk->consts, sizeof(val) * chunk->consts_cap);
+  }
+
+  chunk->consts[chunk->consts_size] = value;
+  return chunk->consts_size++;
+}
+
+uint32_t chunk_add_name(struct vm *vm, struct chunk *chunk, char *id) {
+  assert(chunk != NULL);
+  assert(id != NULL);
+  val name = val_from_obj(symbol_intern(vm, id, strlen(id)));
+  for (size_t ci = 0LL; ci < chunk->consts_size; ci++) {
+    if (chunk->consts[ci] == name) {
+      return ci;
+    }
+  }
+
+  return chunk_add_const(chunk, name);
+}
+
+void chunk_patch(struct chunk *chunk, size_t at, size_t target) {
+  assert(chunk != NULL);
+  assert(at < chunk->code_size);
+  chunk->code[at] = target;
+}
+
+void chunk_dump(struct chunk *chunk) {
+  static const char *names[] = {
+      "CONST",       "LOAD",        "LOAD_GLOBAL", "STORE",     "INDEX",
+      "BIN",         "UNIT",        "CALL",        "JUMP",      "JUMP_FALSE",
+      "JUMP_FILTER", "DUP",         "POP",         "LIST",      "DICT",
+      "DICT_PUT",    "ITER_INIT",   "ITER_NEXT",   "ITER_APPEND", "ITER_END",
+      "ITER_DROP",   "ITER_REDUCE", "LAMBDA",      "RETURN",
+  };
+  static const int operands[] = {
+      1, 2, 1, 1, 0, 1, 1, 1, 1, 2, 1, 0, 0, 1, 0, 1, 1, 1, 0, 0, 0, 2, 2, 0,
+  };
+
+  printf("; params: %lu, slots: %lu\n", chunk->nparams, chunk->nslots);
+  size_t ip = 0LL;
+  while (ip < chunk->code_size) {
+    enum opcode op = chunk->code[ip];
+    printf("%04lu %s", ip, names[op]);
+    for (int oi = 0; oi < operands[op]; oi++) {
+      printf(" %u", chunk->code[ip + 1 + oi]);
+    }
+    printf("\n");
+    ip += 1 + operands[op];
+  }
+}
+
+struct object *compile_function(struct vm *vm, struct compiler *parent,
+                                char *id, struct def_params *params,
+                                struct expr *body) {
+  assert(vm != NULL);
+  assert(body != NULL);
+
+  struct compiler c = {
+      .vm = vm,
+      .parent = parent,
+      .chunk = chunk_new(vm),
+      .id = id != NULL ? id : (parent != NULL ? parent->id : NULL),
+      .locals = malloc(sizeof(struct object *) * DEFAULT_COMPILER_LOCALS_CAP),
+      .locals_size = 0LL,
+      .locals_cap = DEFAULT_COMPILER_LOCALS_CAP,
+  };
+
+  // arguments are pushed by the caller right where the first slots go
+  struct def_params *param = params;
+  while (param != NULL) {
+    compile_declare(&c, param->id);
+    param = param->next;
+  }
+  c.chunk->nparams = c.locals_size;
+
+  compile_expr(&c, body);
+  chunk_emit(c.chunk, BC_RETURN);
+  free(c.locals);
+
+  struct object *object = vm_alloc(vm, true);
+  object->type = TYPE_FUNCTION;
+  object->function = malloc(sizeof(struct function));
+  vm->gc.allocated += sizeof(struct function);
+  *object->function = (struct function){
+      .target = TARGET_SCRIPT,
+      .native_call = NULL,
+      .closure = NULL,
+      .params = params,
+      .chunk = c.chunk,
+      .id = id,
+  };
+
+  return object;
+}
+
+uint32_t compile_declare(struct compiler *c, char *id) {
+  assert(c != NULL);
+  assert(id != NULL);
+  if (c->locals_size == c->locals_cap) {
+    c->locals_cap *= 2;
+    c->locals = realloc(c->locals, sizeof(struct object *) * c->locals_cap);
+  }
+
+  c->locals[c->locals_size] = symbol_intern(c->vm, id, strlen(id));
+  if (c->locals_size + 1 > c->chunk->nslots) {
+    c->chunk->nslots = c->locals_size + 1;
+  }
+
+  return c->locals_size++;
+}
+
+void compile_name(struct compiler *c, char *id, const char *kind) {
+  assert(c != NULL);
+  assert(id != NULL);
+
+  // innermost declarations shadow outer ones, then enclosing functions, a
+  // name never interned cannot have been declared
+  size_t size = strlen(id);
+  struct object *symbol =
+      symbol_lookup(c->vm, id, size, string_hash_chars(id, size));
+  uint32_t depth = 0;
+  struct compiler *cur = symbol != NULL ? c : NULL;
+  while (cur != NULL) {
+    for (size_t li = cur->locals_size; li > 0; li--) {
+      if (cur->locals[li - 1] == symbol) {
+        chunk_emit(c->chunk, BC_LOAD);
+        chunk_emit(c->chunk, depth);
+        chunk_emit(c->chunk, li - 1);
+        return;
+      }
+    }
+
+    depth++;
+    cur = cur->parent;
+  }
+
+  size_t global = 0LL;
+  if (vm_find_global(c->vm, id, &global)) {
+    chunk_emit(c->chunk, BC_LOAD_GLOBAL);
+    chunk_emit(c->chunk, global);
+    return;
+  }
+
+  // unresolved names are reported once here and evaluate to the same error
+  fprintf(stderr, "%s: undefined %s '%s'\n", c->id != NULL ? c->id : "lambda",
+          kind, id);
+  struct object *res = vm_alloc(c->vm, true);
+  res->type = TYPE_ERROR;
+  res->error = malloc(sizeof(char) * DEFAULT_VM_ERROR_SIZE);
+  c->vm->gc.allocated += DEFAULT_VM_ERROR_SIZE;
+  snprintf(res->error, DEFAULT_VM_ERROR_SIZE, "undefined %s '%s'", kind, id);
+  chunk_emit(c->chunk, BC_CONST);
+  chunk_emit(c->chunk, chunk_add_const(c->chunk, val_from_obj(res)));
+}
+
+void compile_expr(struct compiler *c, struct expr *expr) {
+  assert(c != NULL);
+  assert(expr != NULL);
+
+  switch (expr->type) {
+  case EXPR_LIT:
+    compile_lit(c, expr->lit_expr);
+    break;
+  case EXPR_LOOKUP:
+    compile_lookup(c, expr->lookup_expr);
+    break;
+  case EXPR_BIN:
+    compile_bin(c, expr->bin_expr);
+    break;
+  case EXPR_UNIT:
+    compile_unit(c, expr->unit_expr);
+    break;
+  case EXPR_CALL:
+    compile_call(c, expr->call_expr);
+    break;
+  case EXPR_LET:
+    compile_let(c, expr->let_expr);
+    break;
+  case EXPR_DEF:
+    compile_def(c, expr->def_expr);
+    break;
+  case EXPR_IF:
+    compile_if(c, expr->if_expr);
+    break;
+  case EXPR_FOR:
+    compile_for(c, expr->for_expr);
+    break;
+  case EXPR_REDUCE:
+    compile_reduce(c, expr->reduce_expr);
+    break;
+  case EXPR_LIST:
+    compile_list(c, expr->list_expr);
+    break;
+  case EXPR_DICT:
+    compile_dict(c, expr->dict_expr);
+    break;
+  case EXPR_LAMBDA:
+    compile_lambda(c, expr->lambda_expr);
+    break;
+  }
+}
+
+void compile_lit(struct compiler *c, struct lit_expr *lit_expr) {
+  assert(lit_expr != NULL);
+
+  // literals are immutable so they get evaluated once into the chunk, equal
+  // strings share one symbol and integers too wide to be immediate get a root
+  val res = VAL_NULL;
+  if (lit_expr->type == LIT_STRING) {
+    size_t quoted_size = strlen(lit_expr->raw_value);
+    res = val_from_obj(
+        symbol_intern(c->vm, lit_expr->raw_value + 1, quoted_size - 2));
+  } else {
+    struct num num;
+    num_parse(lit_expr->raw_value, strlen(lit_expr->raw_value), &num);
+    if (num.type == NUM_F64) {
+      res = val_from_f64(num.f64);
+    } else if (num.type == NUM_U64 && !val_fits_u64(num.u64)) {
+      struct object *boxed = vm_alloc(c->vm, true);
+      boxed->type = TYPE_U64;
+      boxed->u64 = num.u64;
+      res = val_from_obj(boxed);
+    } else if (num.type == NUM_U64) {
+      res = val_from_small_u64(num.u64);
+    } else if (!val_fits_i64(num.i64)) {
+      struct object *boxed = vm_alloc(c->vm, true);
+      boxed->type = TYPE_I64;
+      boxed->i64 = num.i64;
+      res = val_from_obj(boxed);
+    } else {
+      res = val_from_small_i64(num.i64);
+    }
+  }
+
+  chunk_emit(c->chunk, BC_CONST);
+  chunk_emit(c->chunk, chunk_add_const(c->chunk, res));
+}
+
+void compile_lookup(struct compiler *c, struct lookup_expr *lookup_expr) {
+  assert(lookup_expr != NULL);
+
+  if (lookup_expr->type == LOOKUP_ID) {
+    compile_name(c, lookup_expr->id, "variable");
+  } else {
+    // keep the evaluation order of the tree walker: key first, then base
+    compile_expr(c, lookup_expr->key);
+    compile_expr(c, lookup_expr->object);
+    chunk_emit(c->chunk, BC_INDEX);
+  }
+}
+
+void compile_bin(struct compiler *c, struct bin_expr *bin_expr) {
+  assert(bin_expr != NULL);
+  compile_expr(c, bin_expr->left);
+  compile_expr(c, bin_expr->right);
+  chunk_emit(c->chunk, BC_BIN);
+  chunk_emit(c->chunk, bin_expr->op);
+}
+
+void compile_unit(struct compiler *c, struct unit_expr *unit_expr) {
+  assert(unit_expr != NULL);
+  compile_expr(c, unit_expr->right);
+  chunk_emit(c->chunk, BC_UNIT);
+  chunk_emit(c->chunk, unit_expr->op);
+}
+
+void compile_call(struct compiler *c, struct call_expr *call_expr) {
+  assert(call_expr != NULL);
+  compile_name(c, call_expr->callee, "function");
+
+  uint32_t argc = 0;
+  struct call_args *arg = call_expr->args;
+  while (arg != NULL) {
+    compile_expr(c, arg->expr);
+    argc++;
+    arg = arg->next;
+  }
+
+  chunk_emit(c->chunk, BC_CALL);
+  chunk_emit(c->chunk, argc);
+}
+
+void compile_let(struct compiler *c, struct let_expr *let_expr) {
+  assert(let_expr != NULL);
+
+  // assigns are evaluated within the outer scope, then bound all at once
+  size_t scope = c->locals_size;
+  struct let_assigns *assign = let_expr->assigns;
+  while (assign != NULL) {
+    compile_expr(c, assign->expr);
+    assign = assign->next;
+  }
+
+  assign = let_expr->assigns;
+  while (assign != NULL) {
+    compile_declare(c, assign->id);
+    assign = assign->next;
+  }
+
+  for (size_t li = c->locals_size; li > scope; li--) {
+    chunk_emit(c->chunk, BC_STORE);
+    chunk_emit(c->chunk, li - 1);
+  }
+
+  compile_expr(c, let_expr->in_expr);
+  c->locals_size = scope;
+}
+
+void compile_if(struct compiler *c, struct if_expr *if_expr) {
+  assert(if_expr != NULL);
+
+  // every exit jump of the chain is linked through its own operand until the
+  // end of the whole expression is known
+  size_t exits = 0LL;
+  struct cond_expr *cond = if_expr->conds;
+  while (cond != NULL) {
+    compile_expr(c, cond->cond);
+    chunk_emit(c->chunk, BC_JUMP_FALSE);
+    size_t next_at = chunk_emit(c->chunk, 0);
+    exits = chunk_emit(c->chunk, exits);
+
+    compile_expr(c, cond->then);
+    chunk_emit(c->chunk, BC_JUMP);
+    exits = chunk_emit(c->chunk, exits);
+    chunk_patch(c->chunk, next_at, c->chunk->code_size);
+    cond = cond->next;
+  }
+
+  compile_expr(c, if_expr->else_expr);
+  while (exits != 0) {
+    size_t prev = c->chunk->code[exits];
+    chunk_patch(c->chunk, exits, c->chunk->code_size);
+    exits = prev;
+  }
+}
+
+void compile_for(struct compiler *c, struct for_expr *for_expr) {
+  assert(for_expr != NULL);
+  struct chunk *chunk = c->chunk;
+  size_t scope = c->locals_size;
+
+  compile_expr(c, for_expr->iterator_expr);
+  chunk_emit(chunk, BC_ITER_INIT);
+  size_t exit_at = chunk_emit(chunk, 0);
+
+  // only one iterator handler is supported
+  uint32_t handle = compile_declare(c, for_expr->handle_expr->id);
+  size_t loop = chunk_emit(chunk, BC_ITER_NEXT);
+  size_t done_at = chunk_emit(chunk, 0);
+  chunk_emit(chunk, BC_STORE);
+  chunk_emit(chunk, handle);
+  compile_expr(c, for_expr->iteration_expr);
+
+  size_t skip_at = 0LL;
+  if (for_expr->filter_expr != NULL) {
+    chunk_emit(chunk, BC_DUP);
+    chunk_emit(chunk, BC_STORE);
+    chunk_emit(chunk, compile_declare(c, "it"));
+    compile_expr(c, for_expr->filter_expr);
+    chunk_emit(chunk, BC_JUMP_FILTER);
+    skip_at = chunk_emit(chunk, 0);
+  }
+
+  chunk_emit(chunk, BC_ITER_APPEND);
+  chunk_emit(chunk, BC_JUMP);
+  chunk_emit(chunk, loop);
+
+  if (for_expr->filter_expr != NULL) {
+    chunk_patch(chunk, skip_at, chunk->code_size);
+    chunk_emit(chunk, BC_POP);
+    chunk_emit(chunk, BC_JUMP);
+    chunk_emit(chunk, loop);
+  }
+
+  chunk_patch(chunk, done_at, chunk->code_size);
+  chunk_emit(chunk, BC_ITER_END);
+  chunk_patch(chunk, exit_at, chunk->code_size);
+  c->locals_size = scope;
+}
+
+void compile_reduce(struct compiler *c, struct reduce_expr *reduce_expr) {
+  assert(reduce_expr != NULL);
+  struct for_expr *for_expr = reduce_expr->for_expr;
+  struct chunk *chunk = c->chunk;
+  size_t scope = c->locals_size;
+
+  compile_expr(c, for_expr->iterator_expr);
+  chunk_emit(chunk, BC_ITER_INIT);
+  size_t exit_at = chunk_emit(chunk, 0);
+  compile_expr(c, reduce_expr->value);
+
+  // folds the kernels know skip the loop when the list is packed
+  size_t kernel_at = 0LL;
+  enum reduce_op op;
+  if (compile_match_reduce(reduce_expr, &op)) {
+    chunk_emit(chunk, BC_ITER_REDUCE);
+    chunk_emit(chunk, op);
+    kernel_at = chunk_emit(chunk, 0);
+  }
+
+  // only one iterator handler is supported
+  uint32_t handle = compile_declare(c, for_expr->handle_expr->id);
+  uint32_t carry = compile_declare(c, reduce_expr->id);
+
+  // the carry lives on top of the stack between iterations
+  size_t loop = chunk_emit(chunk, BC_ITER_NEXT);
+  size_t done_at = chunk_emit(chunk, 0);
+  chunk_emit(chunk, BC_STORE);
+  chunk_emit(chunk, handle);
+  chunk_emit(chunk, BC_STORE);
+  chunk_emit(chunk, carry);
+
+  size_t skip_at = 0LL;
+  if (for_expr->filter_expr != NULL) {
+    compile_expr(c, for_expr->filter_expr);
+    chunk_emit(chunk, BC_JUMP_FILTER);
+    skip_at = chunk_emit(chunk, 0);
+  }
+
+  compile_expr(c, for_expr->iteration_expr);
+  chunk_emit(chunk, BC_JUMP);
+  chunk_emit(chunk, loop);
+
+  if (for_expr->filter_expr != NULL) {
+    chunk_patch(chunk, skip_at, chunk->code_size);
+    chunk_emit(chunk, BC_LOAD);
+    chunk_emit(chunk, 0);
+    chunk_emit(chunk, carry);
+    chunk_emit(chunk, BC_JUMP);
+    chunk_emit(chunk, loop);
+  }
+
+  chunk_patch(chunk, done_at, chunk->code_size);
+  chunk_emit(chunk, BC_ITER_DROP);
+  chunk_patch(chunk, exit_at, chunk->code_size);
+  if (kernel_at != 0) {
+    chunk_patch(chunk, kernel_at, chunk->code_size);
+  }
+  c->locals_size = scope;
+}
+
+// Recognizes folds of the carry c and the item n the kernels can run, the
+// operands of the commutative ones may come in either order:
+//   c + n, c * n, c & n, c | n, c ^ n, c && n, c || n, c + 1
+//   if c < n then c else n, and its mirrored forms for min and max
+bool compile_match_reduce(struct reduce_expr *reduce_expr,
+                          enum reduce_op *op_out) {
+  assert(reduce_expr != NULL);
+  struct for_expr *for_expr = reduce_expr->for_expr;
+  char *carry = reduce_expr->id;
+  char *item = for_expr->handle_expr->id;
+  struct expr *step = for_expr->iteration_expr;
+  if (for_expr->filter_expr != NULL || strcmp(carry, item) == 0) {
+    return false;
+  }
+
+  if (step->type == EXPR_BIN) {
+    struct bin_expr *bin = step->bin_expr;
+    struct expr *other = NULL;
+    if (expr_is_id(bin->left, carry)) {
+      other = bin->right;
+    } else if (expr_is_id(bin->right, carry)) {
+      other = bin->left;
+    } else {
+      return false;
+    }
+
+    if (bin->op == OP_ADD && other->type == EXPR_LIT &&
+        other->lit_expr->type == LIT_NUMBER &&
+        strcmp(other->lit_expr->raw_value, "1") == 0) {
+      *op_out = REDUCE_COUNT;
+      return true;
+    }
+
+    if (!expr_is_id(other, item)) {
+      return false;
+    }
+
+    switch (bin->op) {
+    case OP_ADD:
+      *op_out = REDUCE_SUM;
+      return true;
+    case OP_MUL:
+      *op_out = REDUCE_PRODUCT;
+      return true;
+    case OP_AND:
+      *op_out = REDUCE_BIT_AND;
+      return true;
+    case OP_OR:
+      *op_out = REDUCE_BIT_OR;
+      return true;
+    case OP_XOR:
+      *op_out = REDUCE_BIT_XOR;
+      return true;
+    case OP_ANDS:
+      *op_out = REDUCE_ALL;
+      return true;
+    case OP_ORS:
+      *op_out = REDUCE_ANY;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  if (step->type != EXPR_IF || step->if_expr->conds->next != NULL ||
+      step->if_expr->else_expr == NULL) {
+    return false;
+  }
+
+  struct cond_expr *cond = step->if_expr->conds;
+  struct expr *otherwise = step->if_expr->else_expr;
+  if (cond->cond->type != EXPR_BIN) {
+    return false;
+  }
+
+  struct bin_expr *cmp = cond->cond->bin_expr;
+  bool carry_left =
+      expr_is_id(cmp->left, carry) && expr_is_id(cmp->right, item);
+  bool carry_right =
+      expr_is_id(cmp->left, item) && expr_is_id(cmp->right, carry);
+  bool keeps = expr_is_id(cond->then, carry) && expr_is_id(otherwise, item);
+  bool takes = expr_is_id(cond->then, item) && expr_is_id(otherwise, carry);
+  if (!(carry_left || carry_right) || !(keeps || takes)) {
+    return false;
+  }
+
+  // integers equal either way are the same, so only the direction matters
+  bool carry_less = false;
+  switch (cmp->op) {
+  case OP_LT:
+  case OP_LE:
+    carry_less = carry_left;
+    break;
+  case OP_GT:
+  case OP_GE:
+    carry_less = carry_right;
+    break;
+  default:
+    return false;
+  }
+
+  *op_out = carry_less == keeps ? REDUCE_MIN : REDUCE_MAX;
+  return true;
+}
+
+bool expr_is_id(struct expr *expr, char *id) {
+  return expr != NULL && expr->type == EXPR_LOOKUP &&
+         expr->lookup_expr->type == LOOKUP_ID &&
+         strcmp(expr->lookup_expr->id, id) == 0;
+}
+
+void compile_list(struct compiler *c, struct list_expr *list_expr) {
+  uint32_t total = 0;
+  struct list_expr *cur = list_expr;
+  while (cur != NULL) {
+    compile_expr(c, cur->item);
+    total++;
+    cur = cur->next;
+  }
+
+  chunk_emit(c->chunk, BC_LIST);
+  chunk_emit(c->chunk, total);
+}
+
+void compile_dict(struct compiler *c, struct dict_expr *dict_expr) {
+  chunk_emit(c->chunk, BC_DICT);
+  struct dict_expr *cur = dict_expr;
+  while (cur != NULL) {
+    compile_expr(c, cur->value);
+    chunk_emit(c->chunk, BC_DICT_PUT);
+    chunk_emit(c->chunk, chunk_add_name(c->vm, c->chunk, cur->key));
+    cur = cur->next;
+  }
+}
+
+void compile_lambda(struct compiler *c, struct lambda_expr *lambda_expr) {
+  assert(lambda_expr != NULL);
+  struct object *function = compile_function(
+      c->vm, c, NULL, lambda_expr->params, lambda_expr->body);
+  chunk_emit(c->chunk, BC_LAMBDA);
+  chunk_emit(c->chunk, chunk_add_const(c->chunk, val_from_obj(function)));
+  chunk_emit(c->chunk, c->locals_size);
+}
+
+void compile_def(struct compiler *c, struct def_expr *def_expr) {
+  assert(def_expr != NULL);
+
+  // nested defs only see the globals, just like top level ones
+  struct object *function = compile_function(
+      c->vm, NULL, def_expr->id, def_expr->params, def_expr->body);
+  chunk_emit(c->chunk, BC_CONST);
+  chunk_emit(c->chunk, chunk_add_const(c->chunk, val_from_obj(function)));
+}
@@ -0,0 +1,115 @@
+#pragma once
+#include "ast.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct vm;
+struct object;
+
+// Every instruction is one opcode word followed by its operand words, operand
+// names below are the words following the opcode in order (a, b).
+enum opcode {
+  BC_CONST,       // push consts[a]
+  BC_LOAD,        // push slot b of the frame a closures away (0 is current)
+  BC_LOAD_GLOBAL, // push global a
+  BC_STORE,       // pop value into slot a of the current frame
+  BC_INDEX,       // pop key, pop base, push base[key]
+  BC_BIN,         // pop right, pop left, push (left a right)
+  BC_UNIT,        // pop right, push (a right)
+  BC_CALL,        // call the function below a stack arguments
+  BC_JUMP,        // jump to a
+  BC_JUMP_FALSE,  // pop cond, jump to a when false, push error and jump to b
+                  // when cond cannot be evaluated
+  BC_JUMP_FILTER, // pop filter result, jump to a when it rejects the item
+  BC_DUP,         // push top again
+  BC_POP,         // drop top
+  BC_LIST,        // pop a items, push them as a list
+  BC_DICT,        // push an empty dict
+  BC_DICT_PUT,    // pop value, put it into the dict on top as consts[a]
+  BC_ITER_INIT,   // pop iterable and start iterating it, push error and jump
+                  // to a when it cannot be iterated
+  BC_ITER_NEXT,   // push the next item of the current iteration or jump to a
+  BC_ITER_APPEND, // pop value and append it to the current iteration result
+  BC_ITER_END,    // finish the current iteration and push its result list
+  BC_ITER_DROP,   // finish the current iteration discarding its result
+  BC_ITER_REDUCE, // fold the list being iterated into the carry on top with
+                  // reduce_op a and jump to b, go on when it cannot
+  BC_LAMBDA,      // push a closure of the function in consts[a] capturing the
+                  // first b slots of the current frame
+  BC_RETURN,      // return top to the caller
+};
+
+// Folds the reduce compiler recognizes, see compile_match_reduce.
+enum reduce_op {
+  REDUCE_SUM,     // c + n
+  REDUCE_PRODUCT, // c * n
+  REDUCE_BIT_AND, // c & n
+  REDUCE_BIT_OR,  // c | n
+  REDUCE_BIT_XOR, // c ^ n
+  REDUCE_ALL,     // c && n
+  REDUCE_ANY,     // c || n
+  REDUCE_MIN,     // if c < n then c else n
+  REDUCE_MAX,     // if c > n then c else n
+  REDUCE_COUNT,   // c + 1
+};
+
+struct chunk {
+  struct chunk *next;
+  uint32_t *code;
+  size_t code_size;
+  size_t code_cap;
+  val *consts;
+  size_t consts_size;
+  size_t consts_cap;
+  size_t nparams;
+  size_t nslots;
+};
+
+// Resolution state of the function being compiled, locals are kept in the
+// order they get their slots so scopes are just a saved locals_size.
+struct compiler {
+  struct vm *vm;
+  struct compiler *parent;
+  struct chunk *chunk;
+  char *id;
+  struct object **locals;
+  size_t locals_size;
+  size_t locals_cap;
+};
+
+struct chunk *chunk_new(struct vm *vm);
+void chunk_free(struct chunk *chunk);
+size_t chunk_emit(struct chunk *chunk, uint32_t word);
+uint32_t chunk_add_const(struct chunk *chunk, val value);
+uint32_t chunk_add_name(struct vm *vm, struct chunk *chunk, char *id);
+void chunk_patch(struct chunk *chunk, size_t at, size_t target);
+void chunk_dump(struct chunk *chunk);
+
+struct object *compile_function(struct vm *vm, struct compiler *parent,
+                                char *id, struct def_params *params,
+                                struct expr *body);
+uint32_t compile_declare(struct compiler *c, char *id);
+void compile_name(struct compiler *c, char *id, const char *kind);
+void compile_expr(struct compiler *c, struct expr *expr);
+void compile_lit(struct compiler *c, struct lit_expr *lit_expr);
+void compile_lookup(struct compiler *c, struct lookup_expr *lookup_expr);
+void compile_bin(struct compiler *c, struct bin_expr *bin_expr);
+void compile_unit(struct compiler *c, struct unit_expr *unit_expr);
+void compile_call(struct compiler *c, struct call_expr *call_expr);
+void compile_let(struct compiler *c, struct let_expr *let_expr);
+void compile_if(struct compiler *c, struct if_expr *if_expr);
+void compile_for(struct compiler *c, struct for_expr *for_expr);
+void compile_reduce(struct compiler *c, struct reduce_expr *reduce_expr);
+bool compile_match_reduce(struct reduce_expr *reduce_expr,
+                          enum reduce_op *op_out);
+bool expr_is_id(struct expr *expr, char *id);
+void compile_list(struct compiler *c, struct list_expr *list_expr);
+void compile_dict(struct compiler *c, struct dict_expr *dict_expr);
+void compile_lambda(struct compiler *c, struct lambda_expr *lambda_expr);
+void compile_def(struct compiler *c, struct def_expr *def_expr);
+
+#define DEFAULT_CHUNK_CODE_CAP 64
+#define DEFAULT_CHUNK_CONSTS_CAP 8
+#define DEFAULT_COMPILER_LOCALS_CAP 8
@@ -0,0 +1,980 @@
+#include "gc.h"
+#include "vm.h"
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Marking threads push what they shade into their own deque.
+static _Thread_local struct gc_worker *gc_self = NULL;
+
+void gc_init(struct gc *gc) {
+  assert(gc != NULL);
+  gc->nursery.total = DEFAULT_GC_NURSERY_CELLS;
+  gc->nursery.used = 0LL;
+  // cache line aligned just like the cells of heap pages, aligned_alloc
+  // wants the size rounded up to the alignment
+  size_t nursery_size = sizeof(struct object) * gc->nursery.total;
+  gc->nursery.cells = aligned_alloc(64, (nursery_size + 63) / 64 * 64);
+  gc->remembered_size = 0LL;
+  gc->remembered_cap = DEFAULT_GC_REMEMBERED_CAP;
+  gc->remembered = malloc(sizeof(struct object *) * gc->remembered_cap);
+  gc->worklist_size = 0LL;
+  gc->worklist_cap = DEFAULT_GC_WORKLIST_CAP;
+  gc->worklist = malloc(sizeof(struct object *) * gc->worklist_cap);
+  gc->handles_size = 0LL;
+  gc->handles_cap = DEFAULT_GC_HANDLES_CAP;
+  gc->handles = malloc(sizeof(val *) * gc->handles_cap);
+  gc->roots_size = 0LL;
+  gc->roots_cap = DEFAULT_GC_ROOTS_CAP;
+  gc->roots = malloc(sizeof(struct object *) * gc->roots_cap);
+  gc->phase = GC_PHASE_IDLE;
+  gc->grey_size = 0LL;
+  gc->grey_cap = DEFAULT_GC_GREY_CAP;
+  gc->grey = malloc(sizeof(struct object *) * gc->grey_cap);
+  gc->sweep_cursor = NULL;
+  gc_pool_init(&gc->pool, DEFAULT_GC_WORKERS);
+  gc->step_work = DEFAULT_GC_STEP_WORK;
+  gc->step_ns = DEFAULT_GC_STEP_NS;
+  gc->growth = DEFAULT_GC_GROWTH;
+  gc->min_trigger = DEFAULT_GC_MIN_TRIGGER;
+  gc->trigger = DEFAULT_GC_MIN_TRIGGER;
+  gc->allocated = 0LL;
+  gc->marked = 0LL;
+  gc->cycle_freed = 0LL;
+  gc->minor_reclaimed = 0LL;
+  gc->cycles_size = 0LL;
+  gc->cycles_cap = DEFAULT_GC_CYCLES_CAP;
+  gc->cycles = malloc(sizeof(struct gc_cycle) * gc->cycles_cap);
+  gc->print_stats = false;
+  gc->minor_count = 0LL;
+  gc->major_count = 0LL;
+  gc->promoted = 0LL;
+  memset(gc->pauses, 0L, sizeof(gc->pauses));
+  gc->pause_count = 0LL;
+  gc->pause_total_ns = 0LL;
+  gc->pause_max_ns = 0LL;
+}
+
+void gc_free(struct gc *gc) {
+  assert(gc != NULL);
+  free(gc->nursery.cells);
+  free(gc->remembered);
+  free(gc->worklist);
+  free(gc->handles);
+  free(gc->roots);
+  free(gc->grey);
+  free(gc->cycles);
+  gc_pool_free(&gc->pool);
+}
+
+struct object *gc_alloc_young(struct gc *gc) {
+  struct nursery *nursery = &gc->nursery;
+  if (nursery->used == nursery->total) {
+    return NULL;
+  }
+
+  struct object *obj = &nursery->cells[nursery->used++];
+  memset(obj, 0L, sizeof(struct object));
+  return obj;
+}
+
+void gc_remember(struct gc *gc, struct object *obj) {
+  assert(obj != NULL);
+  if (gc->remembered_size == gc->remembered_cap) {
+    gc->remembered_cap *= 2;
+    gc->remembered =
+        realloc(gc->remembered, sizeof(struct object *) * gc->remembered_cap);
+  }
+
+  obj->remembered = true;
+  gc->remembered[gc->remembered_size++] = obj;
+}
+
+void gc_push_work(struct gc *gc, struct object *obj) {
+  if (gc->worklist_size == gc->worklist_cap) {
+    gc->worklist_cap *= 2;
+    gc->worklist =
+        realloc(gc->worklist, sizeof(struct object *) * gc->worklist_cap);
+  }
+
+  gc->worklist[gc->worklist_size++] = obj;
+}
+
+void gc_protect(struct gc *gc, val *handle) {
+  assert(handle != NULL);
+  if (gc->handles_size == gc->handles_cap) {
+    gc->handles_cap *= 2;
+    gc->handles = realloc(gc->handles, sizeof(val *) * gc->handles_cap);
+  }
+
+  gc->handles[gc->handles_size++] = handle;
+}
+
+void gc_add_root(struct gc *gc, struct object *obj) {
+  assert(obj != NULL);
+  if (gc->roots_size == gc->roots_cap) {
+    gc->roots_cap *= 2;
+    gc->roots = realloc(gc->roots, sizeof(struct object *) * gc->roots_cap);
+  }
+
+  gc->roots[gc->roots_size++] = obj;
+}
+
+// Objects are grey while they wait in the stack, they get their mark bit
+// when they are scanned.
+void gc_shade(struct gc *gc, struct object *obj) {
+  if (obj == NULL || gc_is_young(gc, obj) || heap_is_marked(obj)) {
+    return;
+  }
+
+  gc_push_grey(gc, obj);
+}
+
+void gc_push_grey(struct gc *gc, struct object *obj) {
+  if (gc->grey_size == gc->grey_cap) {
+    gc->grey_cap *= 2;
+    gc->grey = realloc(gc->grey, sizeof(struct object *) * gc->grey_cap);
+  }
+
+  gc->grey[gc->grey_size++] = obj;
+}
+
+void gc_set_budget(struct gc *gc, size_t work, uint64_t ns) {
+  assert(gc != NULL);
+  assert(work > 0);
+  gc->step_work = work;
+  gc->step_ns = ns;
+}
+
+void gc_set_workers(struct gc *gc, size_t workers) {
+  assert(gc != NULL);
+  assert(workers > 0);
+  gc_pool_free(&gc->pool);
+  gc_pool_init(&gc->pool, workers);
+}
+
+// A major cycle starts once the old heap has grown by percent of what was
+// alive after the previous one, but never before min_trigger bytes.
+void gc_set_growth(struct gc *gc, size_t percent, size_t min_trigger) {
+  assert(gc != NULL);
+  gc->growth = percent;
+  gc->min_trigger = min_trigger;
+
+  size_t live = 0LL;
+  if (gc->cycles_size > 0) {
+    live = gc->cycles[gc->cycles_size - 1].live;
+  }
+
+  gc->trigger = live / 100 * percent;
+  if (gc->trigger < min_trigger) {
+    gc->trigger = min_trigger;
+  }
+}
+
+// Sizes accept a k, m or g suffix, flags like stats take any value.
+bool gc_set_option(struct gc *gc, const char *name, const char *value) {
+  assert(gc != NULL);
+  char *end = NULL;
+  unsigned long long number = strtoull(value, &end, 10);
+  bool valid = end != value;
+  switch (valid ? *end : '\0') {
+  case 'k':
+  case 'K':
+    number <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    number <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    number <<= 30;
+    end++;
+    break;
+  }
+  valid = valid && *end == '\0';
+
+  if (strcmp(name, "stats") == 0) {
+    gc->print_stats = strcmp(value, "0") != 0;
+  } else if (strcmp(name, "growth") == 0 && valid) {
+    gc_set_growth(gc, number, gc->min_trigger);
+  } else if (strcmp(name, "min-heap") == 0 && valid) {
+    gc_set_growth(gc, gc->growth, number);
+  } else if (strcmp(name, "threads") == 0 && valid && number > 0) {
+    gc_set_workers(gc, number);
+  } else if (strcmp(name, "step-work") == 0 && valid && number > 0) {
+    gc_set_budget(gc, number, gc->step_ns);
+  } else if (strcmp(name, "step-ns") == 0 && valid) {
+    gc_set_budget(gc, gc->step_work, number);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void gc_configure_env(struct gc *gc) {
+  const char *vars[][2] = {
+      {"BEE_GC_GROWTH", "growth"},       {"BEE_GC_MIN_HEAP", "min-heap"},
+      {"BEE_GC_THREADS", "threads"},     {"BEE_GC_STEP_WORK", "step-work"},
+      {"BEE_GC_STEP_NS", "step-ns"},     {"BEE_GC_STATS", "stats"},
+  };
+
+  for (size_t vi = 0LL; vi < sizeof(vars) / sizeof(vars[0]); vi++) {
+    char *value = getenv(vars[vi][0]);
+    if (value != NULL && !gc_set_option(gc, vars[vi][1], value)) {
+      fprintf(stderr, "ignoring invalid %s: %s\n", vars[vi][0], value);
+    }
+  }
+}
+
+// Takes options as --gc-name=value, a bare --gc-name sets it to 1.
+bool gc_configure_arg(struct gc *gc, const char *arg) {
+  if (strncmp(arg, "--gc-", 5) != 0) {
+    return false;
+  }
+
+  char name[32];
+  const char *value = strchr(arg, '=');
+  size_t name_size =
+      value != NULL ? (size_t)(value - arg - 5) : strlen(arg + 5);
+  if (name_size >= sizeof(name)) {
+    return false;
+  }
+
+  memcpy(name, arg + 5, name_size);
+  name[name_size] = '\0';
+  return gc_set_option(gc, name, value != NULL ? value + 1 : "1");
+}
+
+uint64_t gc_now_ns(void) {
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void gc_record_pause(struct gc *gc, uint64_t ns) {
+  // bucket 0 holds pauses under 1us, each next one doubles the bound
+  size_t bucket = 0LL;
+  for (uint64_t us = ns / 1000; us > 0 && bucket + 1 < DEFAULT_GC_PAUSE_BUCKETS;
+       us >>= 1) {
+    bucket++;
+  }
+
+  gc->pauses[bucket]++;
+  gc->pause_count++;
+  gc->pause_total_ns += ns;
+  if (ns > gc->pause_max_ns) {
+    gc->pause_max_ns = ns;
+  }
+}
+
+void gc_print_stats(struct gc *gc, FILE *out) {
+  assert(gc != NULL);
+  fprintf(out, "gc: %zu minor, %zu major, %zu promoted\n", gc->minor_count,
+          gc->major_count, gc->promoted);
+  fprintf(out, "gc: %zu pauses, %lluns total, %lluns max\n", gc->pause_count,
+          (unsigned long long)gc->pause_total_ns,
+          (unsigned long long)gc->pause_max_ns);
+  fprintf(out, "gc: minor reclaimed %zu bytes\n", gc->minor_reclaimed);
+  for (size_t ci = 0LL; ci < gc->cycles_size; ci++) {
+    fprintf(out, "gc: major %zu reclaimed %zu bytes, %zu live\n", ci + 1,
+            gc->cycles[ci].reclaimed, gc->cycles[ci].live);
+  }
+
+  for (size_t bi = 0LL; bi < DEFAULT_GC_PAUSE_BUCKETS; bi++) {
+    if (gc->pauses[bi] == 0) {
+      continue;
+    }
+
+    if (bi + 1 == DEFAULT_GC_PAUSE_BUCKETS) {
+      fprintf(out, "gc:   >= %6lluus %zu\n", 1ULL << (bi - 1), gc->pauses[bi]);
+    } else {
+      fprintf(out, "gc:   <  %6lluus %zu\n", 1ULL << bi, gc->pauses[bi]);
+    }
+  }
+}
+
+void object_visit(struct vm *vm, struct object *obj, gc_visitor visit) {
+  assert(obj != NULL);
+  switch (obj->type) {
+  case TYPE_PAIR:
+    visit(vm, &obj->pair.head);
+    visit(vm, &obj->pair.tail);
+    break;
+  case TYPE_STRING:
+    if (obj->small_size == OBJECT_ROPE_STRING) {
+      visit(vm, &obj->rope.left);
+      visit(vm, &obj->rope.right);
+    }
+    break;
+  case TYPE_LIST:
+    if (obj->list_kind != LIST_VALUES) {
+      break;
+    }
+
+    for (size_t li = 0LL; li < obj->list.size; li++) {
+      visit(vm, &obj->list.items[li]);
+    }
+    break;
+  case TYPE_DICT:
+    // keys are symbols, roots of their own
+    hashmap_for_each(obj->hashmap, slot, { visit(vm, &slot->value); });
+    break;
+  case TYPE_FUNCTION: {
+    // envs are shared with the closures created within this one
+    struct env *env = obj->function->closure;
+    while (env != NULL) {
+      for (size_t si = 0LL; si < env->size; si++) {
+        visit(vm, &env->slots[si]);
+      }
+      env = env->parent;
+    }
+    break;
+  }
+  case TYPE_UNIT:
+  case TYPE_NIL:
+  case TYPE_BOL:
+  case TYPE_U64:
+  case TYPE_I64:
+  case TYPE_F64:
+  case TYPE_ERROR:
+    break;
+  }
+}
+
+void vm_visit_roots(struct vm *vm, gc_visitor visit) {
+  assert(vm != NULL);
+  for (size_t si = 0LL; si < vm->stack_size; si++) {
+    visit(vm, &vm->stack[si]);
+  }
+
+  for (size_t fi = 0LL; fi < vm->frames_size; fi++) {
+    val callee = val_from_obj(vm->frames[fi].callee);
+    visit(vm, &callee);
+    vm->frames[fi].callee = val_as_obj(callee);
+  }
+
+  for (size_t ii = 0LL; ii < vm->iters_size; ii++) {
+    struct iter *iter = &vm->iters[ii];
+    visit(vm, &iter->iterable);
+    visit(vm, &iter->state);
+    for (size_t li = 0LL; li < iter->size; li++) {
+      visit(vm, &iter->items[li]);
+    }
+  }
+
+  for (size_t gi = 0LL; gi < vm->globals_size; gi++) {
+    visit(vm, &vm->globals[gi]);
+  }
+
+  for (size_t hi = 0LL; hi < vm->gc.handles_size; hi++) {
+    visit(vm, vm->gc.handles[hi]);
+  }
+}
+
+void gc_evacuate(struct vm *vm, val *slot) {
+  if (!val_is_obj(*slot)) {
+    return;
+  }
+
+  struct object *obj = val_as_obj(*slot);
+  if (!gc_is_young(&vm->gc, obj)) {
+    return;
+  }
+
+  if (obj->flag == GC_FORWARDED) {
+    *slot = val_from_obj(obj->forward);
+    return;
+  }
+
+  // survivors are promoted straight into the old heap, they start grey
+  // while marking and survive the sweep if their page is still to be swept
+  struct object *promoted = heap_alloc(&vm->heap);
+  vm->gc.allocated += sizeof(struct object);
+  memcpy(promoted, obj, sizeof(struct object));
+  promoted->flag = GC_UNMARKED;
+  promoted->remembered = false;
+  if (vm->gc.phase == GC_PHASE_MARK) {
+    gc_shade(&vm->gc, promoted);
+  } else if (vm->gc.phase == GC_PHASE_SWEEP &&
+             !heap_page_of(promoted)->swept) {
+    heap_mark(promoted);
+  }
+
+  obj->flag = GC_FORWARDED;
+  obj->forward = promoted;
+  *slot = val_from_obj(promoted);
+
+  vm->gc.promoted++;
+  gc_push_work(&vm->gc, promoted);
+}
+
+size_t vm_minor_gc(struct vm *vm) {
+  assert(vm != NULL);
+  struct gc *gc = &vm->gc;
+
+  vm_visit_roots(vm, gc_evacuate);
+  for (size_t ri = 0LL; ri < gc->remembered_size; ri++) {
+    struct object *obj = gc->remembered[ri];
+    obj->remembered = false;
+    object_visit(vm, obj, gc_evacuate);
+  }
+  gc->remembered_size = 0LL;
+
+  while (gc->worklist_size > 0) {
+    object_visit(vm, gc->worklist[--gc->worklist_size], gc_evacuate);
+  }
+
+  // dead cells are never touched again but they may own malloc'd payloads,
+  // this pass only reads their headers
+  size_t collected = 0LL;
+  struct nursery *nursery = &gc->nursery;
+  for (size_t ci = 0LL; ci < nursery->used; ci++) {
+    struct object *obj = &nursery->cells[ci];
+    if (obj->flag != GC_FORWARDED) {
+      gc->minor_reclaimed += object_free(obj);
+      collected++;
+    }
+  }
+
+  nursery->used = 0LL;
+  gc->minor_count++;
+  return collected;
+}
+
+void gc_shade_slot(struct vm *vm, val *slot) {
+  if (val_is_obj(*slot)) {
+    gc_shade(&vm->gc, val_as_obj(*slot));
+  }
+}
+
+void vm_mark_begin(struct vm *vm) {
+  assert(vm->gc.phase == GC_PHASE_IDLE);
+  vm->gc.phase = GC_PHASE_MARK;
+  vm->gc.allocated = 0LL;
+  vm->gc.marked = 0LL;
+  for (size_t ri = 0LL; ri < vm->gc.roots_size; ri++) {
+    vm->gc.marked += object_size(vm->gc.roots[ri]);
+    object_visit(vm, vm->gc.roots[ri], gc_shade_slot);
+  }
+
+  vm_visit_roots(vm, gc_shade_slot);
+}
+
+// Children found while scanning are pushed without looking at them, they are
+// prefetched when they leave the stack and only checked a few scans later
+// once they sit in the ring, so marking does not stall on every pointer.
+// Only their page header is written, never their cell.
+void gc_mark_slot(struct vm *vm, val *slot) {
+  if (val_is_obj(*slot) && !gc_is_young(&vm->gc, val_as_obj(*slot))) {
+    gc_push_grey(&vm->gc, val_as_obj(*slot));
+  }
+}
+
+// Blackens grey objects until none is left or the budget runs out, the
+// clock is only read every few objects.
+bool vm_mark_step(struct vm *vm, size_t budget, uint64_t deadline) {
+  struct gc *gc = &vm->gc;
+  struct object *ring[DEFAULT_GC_PREFETCH_DEPTH];
+  size_t ring_head = 0LL;
+  size_t ring_size = 0LL;
+
+  for (size_t work = 0LL;;) {
+    while (ring_size < DEFAULT_GC_PREFETCH_DEPTH && gc->grey_size > 0) {
+      struct object *obj = gc->grey[--gc->grey_size];
+      __builtin_prefetch(obj, 1);
+      ring[(ring_head + ring_size++) % DEFAULT_GC_PREFETCH_DEPTH] = obj;
+    }
+
+    if (ring_size == 0) {
+      return true;
+    }
+
+    if (work == budget || (deadline != 0 && work % 256 == 255 &&
+                           gc_now_ns() >= deadline)) {
+      // what is left in the ring goes back in the same order it came out
+      while (ring_size > 0) {
+        ring_size--;
+        gc_push_grey(
+            gc, ring[(ring_head + ring_size) % DEFAULT_GC_PREFETCH_DEPTH]);
+      }
+      return false;
+    }
+
+    struct object *obj = ring[ring_head];
+    ring_head = (ring_head + 1) % DEFAULT_GC_PREFETCH_DEPTH;
+    ring_size--;
+
+    if (heap_mark(obj)) {
+      gc->marked += object_size(obj);
+      object_visit(vm, obj, gc_mark_slot);
+      work++;
+    }
+  }
+}
+
+// Roots are not barriered so they are scanned again once the grey objects
+// run out, the nursery is always empty at this point.
+void vm_mark_finish(struct vm *vm) {
+  vm_visit_roots(vm, gc_shade_slot);
+  vm_mark_step(vm, SIZE_MAX, 0);
+
+  for (struct heap_page *page = vm->heap.pages; page != NULL;
+       page = page->next) {
+    page->swept = false;
+  }
+
+  vm->gc.sweep_cursor = vm->heap.pages;
+  vm->gc.phase = GC_PHASE_SWEEP;
+}
+
+bool vm_sweep_step(struct vm *vm, size_t budget, uint64_t deadline,
+                   size_t *collected) {
+  struct gc *gc = &vm->gc;
+  struct gc_worker *worker = &gc->pool.workers[0];
+  worker->free_head = NULL;
+  worker->free_tail = NULL;
+  worker->freed = 0LL;
+  worker->collected = 0LL;
+  worker->reclaimed = 0LL;
+
+  size_t work = 0LL;
+  bool done = true;
+  while (gc->sweep_cursor != NULL) {
+    if (work >= budget || (deadline != 0 && gc_now_ns() >= deadline)) {
+      done = false;
+      break;
+    }
+
+    struct heap_page *page = gc->sweep_cursor;
+    gc_sweep_page(worker, page);
+    work += page->used;
+    gc->sweep_cursor = page->next;
+  }
+
+  heap_release_list(&vm->heap, worker->free_head, worker->free_tail,
+                    worker->freed);
+  gc->cycle_freed += worker->reclaimed;
+  *collected += worker->collected;
+  if (done) {
+    vm_end_cycle(vm);
+  }
+  return done;
+}
+
+// Only cells without their mark bit are looked at, the bitmap is scanned a
+// word at a time and cleared for the next cycle.
+void gc_sweep_page(struct gc_worker *worker, struct heap_page *page) {
+  struct object *cells = heap_page_cells(page);
+  for (size_t wi = 0LL; wi * 64 < page->used; wi++) {
+    uint64_t dead = ~page->marks[wi];
+    if (page->used - wi * 64 < 64) {
+      dead &= (1ULL << (page->used - wi * 64)) - 1;
+    }
+
+    while (dead != 0) {
+      struct object *obj = &cells[wi * 64 + __builtin_ctzll(dead)];
+      dead &= dead - 1;
+      if (obj->flag == GC_FREE || obj->flag == GC_ROOT) {
+        continue;
+      }
+
+      worker->reclaimed += object_free(obj);
+      worker->collected++;
+      obj->flag = GC_FREE;
+      obj->free_next = worker->free_head;
+      if (worker->free_head == NULL) {
+        worker->free_tail = obj;
+      }
+      worker->free_head = obj;
+      worker->freed++;
+    }
+
+    page->marks[wi] = 0LL;
+  }
+
+  page->swept = true;
+}
+
+// Records what the finished cycle reclaimed and sets when the next one starts
+// from the bytes it found alive, payloads included.
+void vm_end_cycle(struct vm *vm) {
+  struct gc *gc = &vm->gc;
+  if (gc->cycles_size == gc->cycles_cap) {
+    gc->cycles_cap *= 2;
+    gc->cycles =
+        realloc(gc->cycles, sizeof(struct gc_cycle) * gc->cycles_cap);
+  }
+
+  gc->cycles[gc->cycles_size++] = (struct gc_cycle){
+      .reclaimed = gc->cycle_freed,
+      .live = gc->marked,
+  };
+
+  gc_set_growth(gc, gc->growth, gc->min_trigger);
+  gc->cycle_freed = 0LL;
+  gc->phase = GC_PHASE_IDLE;
+  gc->major_count++;
+}
+
+// Finishes the current cycle, or runs a whole one, without yielding to the
+// vm. Marking and sweeping are split across the pool workers.
+size_t vm_major_gc(struct vm *vm) {
+  assert(vm != NULL);
+  size_t collected = 0LL;
+  if (vm->gc.nursery.used > 0) {
+    collected += vm_minor_gc(vm);
+  }
+
+  if (vm->gc.phase == GC_PHASE_SWEEP) {
+    vm_par_sweep(vm, &collected);
+  }
+
+  if (vm->gc.phase == GC_PHASE_IDLE) {
+    vm_mark_begin(vm);
+  }
+
+  vm_par_mark(vm);
+  vm_mark_finish(vm);
+  vm_par_sweep(vm, &collected);
+  return collected;
+}
+
+size_t vm_gc(struct vm *vm) {
+  assert(vm != NULL);
+  uint64_t start = gc_now_ns();
+  struct gc *gc = &vm->gc;
+
+  // the nursery is always emptied first so the major one only sees old cells
+  size_t collected = vm_minor_gc(vm);
+  uint64_t deadline = gc->step_ns != 0 ? start + gc->step_ns : 0;
+
+  switch (gc->phase) {
+  case GC_PHASE_IDLE:
+    if (gc->allocated < gc->trigger) {
+      break;
+    }
+
+    // with more than one worker a whole cycle is done at once in parallel
+    if (gc->pool.size > 1) {
+      collected += vm_major_gc(vm);
+    } else {
+      vm_mark_begin(vm);
+    }
+    break;
+  case GC_PHASE_MARK:
+    if (vm_mark_step(vm, gc->step_work, deadline)) {
+      vm_mark_finish(vm);
+    }
+    break;
+  case GC_PHASE_SWEEP:
+    vm_sweep_step(vm, gc->step_work, deadline, &collected);
+    break;
+  }
+
+  gc_record_pause(gc, gc_now_ns() - start);
+  return collected;
+}
+
+void gc_pool_init(struct gc_pool *pool, size_t size) {
+  assert(pool != NULL);
+  assert(size > 0);
+  pool->vm = NULL;
+  pool->size = size;
+  pool->task = NULL;
+  pool->generation = 0LL;
+  pool->running = 0LL;
+  pool->stop = false;
+  pool->idle = 0LL;
+  pool->pages_size = 0LL;
+  pool->pages_cap = 0LL;
+  pool->pages_next = 0LL;
+  pool->pages = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  pool->workers = calloc(size, sizeof(struct gc_worker));
+  for (size_t wi = 0LL; wi < size; wi++) {
+    struct gc_worker *worker = &pool->workers[wi];
+    worker->pool = pool;
+    pthread_mutex_init(&worker->deque.lock, NULL);
+    worker->deque.size = 0LL;
+    worker->deque.cap = DEFAULT_GC_DEQUE_CAP;
+    worker->deque.items = malloc(sizeof(struct object *) * worker->deque.cap);
+  }
+
+  for (size_t wi = 1LL; wi < size; wi++) {
+    pthread_create(&pool->workers[wi].thread, NULL, gc_pool_thread,
+                   &pool->workers[wi]);
+  }
+}
+
+void gc_pool_free(struct gc_pool *pool) {
+  assert(pool != NULL);
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t wi = 1LL; wi < pool->size; wi++) {
+    pthread_join(pool->workers[wi].thread, NULL);
+  }
+
+  for (size_t wi = 0LL; wi < pool->size; wi++) {
+    pthread_mutex_destroy(&pool->workers[wi].deque.lock);
+    free(pool->workers[wi].deque.items);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool->pages);
+}
+
+void gc_pool_run(struct gc_pool *pool, struct vm *vm, gc_task task) {
+  pthread_mutex_lock(&pool->lock);
+  pool->vm = vm;
+  pool->task = task;
+  pool->idle = 0LL;
+  pool->running = pool->size - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  gc_self = &pool->workers[0];
+  task(&pool->workers[0]);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void *gc_pool_thread(void *arg) {
+  struct gc_worker *worker = arg;
+  struct gc_pool *pool = worker->pool;
+  size_t seen = 0LL;
+  gc_self = worker;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->generation == seen) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+
+    if (pool->stop) {
+      break;
+    }
+
+    seen = pool->generation;
+    gc_task task = pool->task;
+    pthread_mutex_unlock(&pool->lock);
+
+    task(worker);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+void gc_deque_push(struct gc_deque *deque, struct object *obj) {
+  pthread_mutex_lock(&deque->lock);
+  if (deque->size == deque->cap) {
+    deque->cap *= 2;
+    deque->items =
+        realloc(deque->items, sizeof(struct object *) * deque->cap);
+  }
+
+  // size is also peeked without the lock by idle workers
+  deque->items[deque->size] = obj;
+  __atomic_store_n(&deque->size, deque->size + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&deque->lock);
+}
+
+bool gc_deque_pop(struct gc_deque *deque, struct object **obj) {
+  pthread_mutex_lock(&deque->lock);
+  bool found = deque->size > 0;
+  if (found) {
+    *obj = deque->items[deque->size - 1];
+    __atomic_store_n(&deque->size, deque->size - 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+// Moves the older half of from into into, returns how many were taken.
+size_t gc_deque_steal(struct gc_deque *from, struct gc_deque *into) {
+  struct object *stolen[DEFAULT_GC_DEQUE_CAP / 2];
+  pthread_mutex_lock(&from->lock);
+  size_t total = (from->size + 1) / 2;
+  if (total > DEFAULT_GC_DEQUE_CAP / 2) {
+    total = DEFAULT_GC_DEQUE_CAP / 2;
+  }
+
+  memcpy(stolen, from->items, sizeof(struct object *) * total);
+  memmove(from->items, from->items + total,
+          sizeof(struct object *) * (from->size - total));
+  __atomic_store_n(&from->size, from->size - total, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&from->lock);
+
+  for (size_t si = 0LL; si < total; si++) {
+    gc_deque_push(into, stolen[si]);
+  }
+
+  return total;
+}
+
+void gc_par_shade_slot(struct vm *vm, val *slot) {
+  if (!val_is_obj(*slot)) {
+    return;
+  }
+
+  struct object *obj = val_as_obj(*slot);
+  if (gc_is_young(&vm->gc, obj)) {
+    return;
+  }
+
+  // objects may be pushed by several threads, only the one setting the mark
+  // bit when popping it gets to scan it
+  if (!heap_is_marked(obj)) {
+    gc_deque_push(&gc_self->deque, obj);
+  }
+}
+
+void gc_par_mark_task(struct gc_worker *worker) {
+  struct gc_pool *pool = worker->pool;
+  struct vm *vm = pool->vm;
+  struct object *obj = NULL;
+
+  for (;;) {
+    while (gc_deque_pop(&worker->deque, &obj)) {
+      if (heap_mark_atomic(obj)) {
+        worker->marked += object_size(obj);
+        object_visit(vm, obj, gc_par_shade_slot);
+      }
+    }
+
+    bool stolen = false;
+    for (size_t wi = 0LL; wi < pool->size && !stolen; wi++) {
+      struct gc_worker *victim = &pool->workers[wi];
+      stolen = victim != worker && gc_deque_steal(&victim->deque,
+                                                  &worker->deque) > 0;
+    }
+
+    if (stolen) {
+      continue;
+    }
+
+    // everyone being idle at once means no grey object is left anywhere
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_ACQ_REL);
+    for (;;) {
+      if (__atomic_load_n(&pool->idle, __ATOMIC_ACQUIRE) == pool->size) {
+        return;
+      }
+
+      bool pending = false;
+      for (size_t wi = 0LL; wi < pool->size && !pending; wi++) {
+        pending = __atomic_load_n(&pool->workers[wi].deque.size,
+                                  __ATOMIC_RELAXED) > 0;
+      }
+
+      if (pending) {
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_ACQ_REL);
+        break;
+      }
+
+      sched_yield();
+    }
+  }
+}
+
+void gc_par_sweep_task(struct gc_worker *worker) {
+  struct gc_pool *pool = worker->pool;
+  worker->free_head = NULL;
+  worker->free_tail = NULL;
+  worker->freed = 0LL;
+  worker->collected = 0LL;
+  worker->reclaimed = 0LL;
+
+  for (;;) {
+    size_t pi = __atomic_fetch_add(&pool->pages_next, 1, __ATOMIC_RELAXED);
+    if (pi >= pool->pages_size) {
+      return;
+    }
+
+    gc_sweep_page(worker, pool->pages[pi]);
+  }
+}
+
+void vm_par_mark(struct vm *vm) {
+  struct gc *gc = &vm->gc;
+  struct gc_pool *pool = &gc->pool;
+  assert(gc->phase == GC_PHASE_MARK);
+  if (pool->size == 1) {
+    vm_mark_step(vm, SIZE_MAX, 0);
+    return;
+  }
+
+  // the grey stack is dealt round robin to start everyone with some work
+  for (size_t gi = 0LL; gi < gc->grey_size; gi++) {
+    gc_deque_push(&pool->workers[gi % pool->size].deque, gc->grey[gi]);
+  }
+  gc->grey_size = 0LL;
+
+  for (size_t wi = 0LL; wi < pool->size; wi++) {
+    pool->workers[wi].marked = 0LL;
+  }
+
+  gc_pool_run(pool, vm, gc_par_mark_task);
+  for (size_t wi = 0LL; wi < pool->size; wi++) {
+    gc->marked += pool->workers[wi].marked;
+  }
+}
+
+void vm_par_sweep(struct vm *vm, size_t *collected) {
+  struct gc *gc = &vm->gc;
+  struct gc_pool *pool = &gc->pool;
+  assert(gc->phase == GC_PHASE_SWEEP);
+  if (pool->size == 1) {
+    vm_sweep_step(vm, SIZE_MAX, 0, collected);
+    return;
+  }
+
+  // pages left by the incremental sweep are handed out one at a time
+  pool->pages_size = 0LL;
+  pool->pages_next = 0LL;
+  for (struct heap_page *page = gc->sweep_cursor; page != NULL;
+       page = page->next) {
+    if (pool->pages_size == pool->pages_cap) {
+      pool->pages_cap = pool->pages_cap == 0 ? 64 : pool->pages_cap * 2;
+      pool->pages =
+          realloc(pool->pages, sizeof(struct heap_page *) * pool->pages_cap);
+    }
+    pool->pages[pool->pages_size++] = page;
+  }
+
+  gc_pool_run(pool, vm, gc_par_sweep_task);
+
+  for (size_t wi = 0LL; wi < pool->size; wi++) {
+    struct gc_worker *worker = &pool->workers[wi];
+    heap_release_list(&vm->heap, worker->free_head, worker->free_tail,
+                      worker->freed);
+    gc->cycle_freed += worker->reclaimed;
+    *collected += worker->collected;
+  }
+
+  gc->sweep_cursor = NULL;
+  vm_end_cycle(vm);
+}
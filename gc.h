@@ -0,0 +1,214 @@
+#pragma once
+#include "value.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct vm;
+struct object;
+struct heap_page;
+struct gc_pool;
+
+#define DEFAULT_GC_PAUSE_BUCKETS 16
+
+// Young objects are bump allocated here and copied into the old heap when
+// they survive a minor collection.
+struct nursery {
+  struct object *cells;
+  size_t used;
+  size_t total;
+};
+
+// Grey objects owned by one marking thread, the others steal from the bottom
+// once they run out of their own.
+struct gc_deque {
+  pthread_mutex_t lock;
+  struct object **items;
+  size_t size;
+  size_t cap;
+};
+
+struct gc_worker {
+  struct gc_pool *pool;
+  struct gc_deque deque;
+  struct object *free_head;
+  struct object *free_tail;
+  size_t freed;
+  size_t collected;
+  size_t reclaimed;
+  size_t marked;
+  pthread_t thread;
+};
+
+typedef void (*gc_task)(struct gc_worker *);
+
+struct gc_cycle {
+  size_t reclaimed;
+  size_t live;
+};
+
+// Worker 0 is the thread running the vm, the others wait for a task to be
+// posted and run it to completion together.
+struct gc_pool {
+  struct vm *vm;
+  struct gc_worker *workers;
+  size_t size;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  gc_task task;
+  size_t generation;
+  size_t running;
+  bool stop;
+  size_t idle;
+  struct heap_page **pages;
+  size_t pages_size;
+  size_t pages_cap;
+  size_t pages_next;
+};
+
+// Major collections advance one step after every minor one, marking
+// reachable old objects grey to black and then sweeping the white ones a few
+// pages at a time.
+enum gc_phase { GC_PHASE_IDLE = 0, GC_PHASE_MARK, GC_PHASE_SWEEP };
+
+struct gc {
+  struct nursery nursery;
+  struct object **remembered;
+  size_t remembered_size;
+  size_t remembered_cap;
+  struct object **worklist;
+  size_t worklist_size;
+  size_t worklist_cap;
+  val **handles;
+  size_t handles_size;
+  size_t handles_cap;
+  struct object **roots;
+  size_t roots_size;
+  size_t roots_cap;
+  enum gc_phase phase;
+  struct object **grey;
+  size_t grey_size;
+  size_t grey_cap;
+  struct heap_page *sweep_cursor;
+  struct gc_pool pool;
+  size_t step_work;
+  uint64_t step_ns;
+  size_t growth;
+  size_t min_trigger;
+  size_t trigger;
+  // bytes of cells and their payloads
+  size_t allocated;
+  size_t marked;
+  size_t cycle_freed;
+  size_t minor_reclaimed;
+  struct gc_cycle *cycles;
+  size_t cycles_size;
+  size_t cycles_cap;
+  bool print_stats;
+  size_t minor_count;
+  size_t major_count;
+  size_t promoted;
+  size_t pauses[DEFAULT_GC_PAUSE_BUCKETS];
+  size_t pause_count;
+  uint64_t pause_total_ns;
+  uint64_t pause_max_ns;
+};
+
+typedef void (*gc_visitor)(struct vm *, val *);
+
+void gc_init(struct gc *gc);
+void gc_free(struct gc *gc);
+struct object *gc_alloc_young(struct gc *gc);
+void gc_remember(struct gc *gc, struct object *obj);
+void gc_push_work(struct gc *gc, struct object *obj);
+void gc_protect(struct gc *gc, val *handle);
+void gc_add_root(struct gc *gc, struct object *obj);
+void gc_shade(struct gc *gc, struct object *obj);
+void gc_push_grey(struct gc *gc, struct object *obj);
+void gc_set_budget(struct gc *gc, size_t work, uint64_t ns);
+void gc_set_workers(struct gc *gc, size_t workers);
+void gc_set_growth(struct gc *gc, size_t percent, size_t min_trigger);
+bool gc_set_option(struct gc *gc, const char *name, const char *value);
+void gc_configure_env(struct gc *gc);
+bool gc_configure_arg(struct gc *gc, const char *arg);
+uint64_t gc_now_ns(void);
+void gc_record_pause(struct gc *gc, uint64_t ns);
+void gc_print_stats(struct gc *gc, FILE *out);
+
+void object_visit(struct vm *vm, struct object *obj, gc_visitor visit);
+void vm_visit_roots(struct vm *vm, gc_visitor visit);
+void gc_evacuate(struct vm *vm, val *slot);
+void gc_shade_slot(struct vm *vm, val *slot);
+void gc_mark_slot(struct vm *vm, val *slot);
+
+size_t vm_minor_gc(struct vm *vm);
+void vm_mark_begin(struct vm *vm);
+bool vm_mark_step(struct vm *vm, size_t budget, uint64_t deadline);
+void vm_mark_finish(struct vm *vm);
+bool vm_sweep_step(struct vm *vm, size_t budget, uint64_t deadline,
+                   size_t *collected);
+void vm_end_cycle(struct vm *vm);
+size_t vm_major_gc(struct vm *vm);
+size_t vm_gc(struct vm *vm);
+
+void gc_pool_init(struct gc_pool *pool, size_t size);
+void gc_pool_free(struct gc_pool *pool);
+void gc_pool_run(struct gc_pool *pool, struct vm *vm, gc_task task);
+void *gc_pool_thread(void *arg);
+void gc_deque_push(struct gc_deque *deque, struct object *obj);
+bool gc_deque_pop(struct gc_deque *deque, struct object **obj);
+size_t gc_deque_steal(struct gc_deque *from, struct gc_deque *into);
+void gc_par_shade_slot(struct vm *vm, val *slot);
+void gc_par_mark_task(struct gc_worker *worker);
+void gc_par_sweep_task(struct gc_worker *worker);
+void gc_sweep_page(struct gc_worker *worker, struct heap_page *page);
+void vm_par_mark(struct vm *vm);
+void vm_par_sweep(struct vm *vm, size_t *collected);
+
+#define DEFAULT_GC_NURSERY_CELLS 4096
+#define DEFAULT_GC_REMEMBERED_CAP 64
+#define DEFAULT_GC_WORKLIST_CAP 256
+#define DEFAULT_GC_HANDLES_CAP 64
+#define DEFAULT_GC_ROOTS_CAP 64
+#define DEFAULT_GC_GREY_CAP 256
+#define DEFAULT_GC_STEP_WORK 4096
+#define DEFAULT_GC_STEP_NS 0
+#define DEFAULT_GC_WORKERS 1
+#define DEFAULT_GC_DEQUE_CAP 256
+#define DEFAULT_GC_PREFETCH_DEPTH 8
+#define DEFAULT_GC_GROWTH 100
+#define DEFAULT_GC_MIN_TRIGGER (4 * 1024 * 1024)
+#define DEFAULT_GC_CYCLES_CAP 16
+
+// Any allocation may collect and move young objects, C locals holding values
+// across one must be registered with gc_protect inside a scope so they are
+// traced and updated. Scopes nest like the C calls opening them.
+#define gc_scope_open(gc) ((gc)->handles_size)
+#define gc_scope_close(gc, scope) ((gc)->handles_size = (scope))
+
+#define gc_is_young(gc, obj)                                                   \
+  ((obj) != NULL && (obj) >= (gc)->nursery.cells &&                            \
+   (obj) < (gc)->nursery.cells + (gc)->nursery.total)
+
+// Must follow every store of a reference into an object field, old objects
+// pointing to young ones are scanned as roots by the next minor collection,
+// and while marking a black owner turns the stored value grey. Immediate
+// values need neither.
+#define gc_write_barrier(vm, owner, value)                                     \
+  do {                                                                         \
+    if (!val_is_obj(value)) {                                                  \
+      break;                                                                   \
+    }                                                                          \
+    struct object *gc_stored = val_as_obj(value);                              \
+    if (!(owner)->remembered && gc_is_young(&(vm)->gc, gc_stored) &&           \
+        !gc_is_young(&(vm)->gc, (owner))) {                                    \
+      gc_remember(&(vm)->gc, (owner));                                         \
+    }                                                                          \
+    if ((vm)->gc.phase == GC_PHASE_MARK && !gc_is_young(&(vm)->gc, (owner)) && \
+        heap_is_marked(owner)) {                                               \
+      gc_shade(&(vm)->gc, gc_stored);                                          \
+    }                                                                          \
+  } while (0)
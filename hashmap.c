@@ -1,15 +1,12 @@
-#define _GNU_SOURCE
 #include "hashmap.h"
 #include <assert.h>
 #include <stdbool.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define hashmap_hash murmur_oaat64
-uint64_t murmur_oaat64(const char *key) {
+uint64_t murmur_oaat64(const char *key, size_t size) {
   uint64_t h = 525201411107845655ull;
-  for (; *key; ++key) {
+  for (const char *end = key + size; key < end; ++key) {
     h ^= *key;
     h *= 0x5bd1e9955bd1e995;
     h ^= h >> 47;
@@ -17,246 +14,191 @@ uint64_t murmur_oaat64(const char *key) {
   return h;
 }
 
-void hashmap_init(struct hashmap *hm, size_t total_rows, size_t max_objects) {
+void hashmap_init(struct hashmap *hm, size_t cap) {
   assert(hm != NULL);
-  size_t buffer_size = sizeof(struct kv_entry *) * total_rows;
-  hm->total_rows = total_rows;
-  hm->max_objects = max_objects;
-  hm->total_objects = 0LL;
-  hm->rehash_state = REHASH_A;
-  hm->rows = malloc(buffer_size);
-  memset(hm->rows, 0L, buffer_size);
+  hashmap_table_init(&hm->table, cap);
+  hm->old = (struct hashmap_table){.slots = NULL, .ctrl = NULL, .cap = 0LL};
+  hm->old_cursor = 0LL;
+  hm->size = 0LL;
 }
 
 void hashmap_free(struct hashmap *hm) {
   assert(hm != NULL);
-  if (hm->rows != NULL) {
-    struct kv_entry **rows = hm->rows;
-    for (size_t ri = 0LL; ri < hm->total_rows; ri++) {
-      struct kv_entry *row = rows[ri];
-      struct kv_entry *tmp = NULL;
-
-      while (row != NULL) {
-        tmp = row->next;
-        if (row->key != NULL) {
-          free(row->key);
-        }
-        free(row);
-        row = tmp;
-      }
-    }
-
-    free(hm->rows);
-  }
+  hashmap_table_free(&hm->table);
+  hashmap_table_free(&hm->old);
 }
 
-enum hashmap_state hashmap_put(struct hashmap *hm, char *key,
-                               struct object *value) {
+enum hashmap_state hashmap_put(struct hashmap *hm, struct object *key,
+                               val value) {
   assert(hm != NULL);
   assert(key != NULL);
+  hashmap_rehash(hm, DEFAULT_HM_REHASH_STEP);
 
-  uint64_t index = hashmap_reduce(hashmap_hash(key), hm->total_rows);
-  struct kv_entry *head = hm->rows[index];
-  if (head == NULL) {
-    head = malloc(sizeof(struct kv_entry));
-    head->next = NULL;
-    head->key = strdup(key);
-    head->value = value;
-    head->rehash_state = hm->rehash_state;
-    hm->rows[index] = head;
-    hm->total_objects++;
-  } else {
-    struct kv_entry *tmp = head;
-    struct kv_entry *place_after = NULL;
-    struct kv_entry *replace = NULL;
-    while (tmp != NULL) {
-      if (strcmp(tmp->key, key) == 0) {
-        replace = tmp;
-        break;
-      }
-
-      place_after = tmp;
-      tmp = tmp->next;
-    }
+  // keys not moved yet are updated where they are
+  size_t at = 0LL;
+  if (hashmap_find(&hm->table, key, &at)) {
+    hm->table.slots[at].value = value;
+    return HM_OK;
+  }
 
-    struct kv_entry *new_entry = malloc(sizeof(struct kv_entry));
-    new_entry->key = strdup(key);
-    new_entry->value = value;
-    new_entry->rehash_state = hm->rehash_state;
+  if (hashmap_find(&hm->old, key, &at)) {
+    hm->old.slots[at].value = value;
+    return HM_OK;
+  }
 
-    if (replace != NULL && place_after != NULL) {
-      // replace within body
-      new_entry->next = replace->next;
-      free(replace);
-      place_after->next = new_entry;
-    } else if (replace != NULL && place_after == NULL) {
-      // replace head
-      new_entry->next = replace->next;
-      free(replace);
-      hm->rows[index] = new_entry;
-    } else if (place_after != NULL) {
-      // insert within list body or tail
-      new_entry->next = place_after->next;
-      place_after->next = new_entry;
-      hm->total_objects++;
-    } else if (replace == NULL && place_after == NULL) {
-      // insert within list head
-      new_entry->next = NULL;
-      hm->rows[index] = new_entry;
-      hm->total_objects++;
-    } else {
-      free(new_entry);
-      return HM_INCONSISTENT_STATE;
+  if (hm->table.growth_left == 0) {
+    // mostly deleted slots are cleared at the same size
+    size_t cap = hm->size * 2 < hm->table.cap ? hm->table.cap
+                                               : hm->table.cap * 2;
+    enum hashmap_state state = hashmap_grow(hm, cap);
+    if (state != HM_OK) {
+      return state;
     }
   }
 
-  // TODO: this is not available yet ...
-  // if (hm->max_objects * DEFAULT_HM_LOAD_FACTOR > hm->total_objects) {
-  //   return hashmap_grow(hm, DEFAULT_HM_GROW_FACTOR);
-  // }
-
+  hashmap_table_insert(&hm->table,
+                       (struct hashmap_slot){.key = key, .value = value});
+  hm->size++;
   return HM_OK;
 }
 
-enum hashmap_state hashmap_get(struct hashmap *hm, char *key,
-                               struct object **value_out) {
+enum hashmap_state hashmap_get(struct hashmap *hm, struct object *key,
+                               val *value_out) {
   assert(hm != NULL);
   assert(key != NULL);
   assert(value_out != NULL);
+  hashmap_rehash(hm, DEFAULT_HM_REHASH_STEP);
 
-  uint64_t index = hashmap_reduce(hashmap_hash(key), hm->total_rows);
-  struct kv_entry *list = hm->rows[index];
-  if (list != NULL) {
-    struct kv_entry *cur = list;
-    while (cur != NULL) {
-      if (strncmp(cur->key, key, strlen(key)) == 0L) {
-        *value_out = cur->value;
-        return HM_OK;
-      }
-      cur = cur->next;
-    }
+  size_t at = 0LL;
+  if (hashmap_find(&hm->table, key, &at)) {
+    *value_out = hm->table.slots[at].value;
+    return HM_OK;
+  }
+
+  if (hashmap_find(&hm->old, key, &at)) {
+    *value_out = hm->old.slots[at].value;
+    return HM_OK;
   }
 
   return HM_KEY_NOT_FOUND;
 }
 
-enum hashmap_state hashmap_del(struct hashmap *hm, char *key) {
+enum hashmap_state hashmap_del(struct hashmap *hm, struct object *key) {
   assert(hm != NULL);
   assert(key != NULL);
+  hashmap_rehash(hm, DEFAULT_HM_REHASH_STEP);
 
-  uint64_t index = hashmap_reduce(hashmap_hash(key), hm->total_rows);
-  struct kv_entry *list = hm->rows[index];
-  if (list != NULL) {
-    struct kv_entry *head = list;
-    struct kv_entry *last = NULL;
-    struct kv_entry *cur = head;
-    while (cur != NULL) {
-      if (strncmp(cur->key, key, strlen(key)) == 0L) {
-        if (cur == head) {
-          // delete list head
-          hm->rows[index] = cur->next;
-          free(cur);
-        } else if (cur->next == NULL) {
-          // delete list tail
-          last->next = NULL;
-          free(cur);
-        } else {
-          // delete item within list body
-          last->next = cur->next;
-          free(cur);
-        }
-
-        break;
-      }
-
-      last = cur;
-      cur = cur->next;
-    }
+  size_t at = 0LL;
+  if (hashmap_find(&hm->table, key, &at)) {
+    hashmap_table_erase(&hm->table, at);
+  } else if (hashmap_find(&hm->old, key, &at)) {
+    hashmap_table_erase(&hm->old, at);
+  } else {
+    return HM_KEY_NOT_FOUND;
   }
 
-  return HM_KEY_NOT_FOUND;
+  hm->size--;
+  return HM_OK;
 }
 
-enum hashmap_state hashmap_grow(struct hashmap *hm, size_t grow_factor) {
+// Starts moving every key into a fresh table of cap slots, which drops the
+// deleted ones. Keys left by a grow still in progress go over at once.
+enum hashmap_state hashmap_grow(struct hashmap *hm, size_t cap) {
   assert(hm != NULL);
-  assert(grow_factor > 1);
+  assert(cap * DEFAULT_HM_LOAD_NUM / DEFAULT_HM_LOAD_DEN > hm->size);
 
-  printf("total objects: %lu\n", hm->total_objects);
-  printf("old total rows: %lu\n", hm->total_rows);
-  size_t new_total_rows = hm->total_rows * grow_factor;
-  printf("new total rows: %lu\n", new_total_rows);
-
-  printf("old max objects: %lu\n", hm->max_objects);
-  size_t new_max_objects = hm->max_objects * grow_factor;
-  printf("new max objects: %lu\n", new_max_objects);
+  struct hashmap_table from = hm->table;
+  hashmap_table_init(&hm->table, cap);
+  hashmap_rehash(hm, SIZE_MAX);
+  hm->old = from;
+  hm->old_cursor = 0LL;
+  return HM_OK;
+}
 
-  size_t new_size = sizeof(struct kv_entry *) * new_total_rows;
+// Moves the keys of up to steps old slots into the current table.
+void hashmap_rehash(struct hashmap *hm, size_t steps) {
+  assert(hm != NULL);
+  if (hm->old.cap == 0) {
+    return;
+  }
 
-  hm->total_rows = new_total_rows;
-  hm->max_objects = new_max_objects;
-  hm->rows = realloc(hm->rows, new_size);
-  if (hm->rows == NULL) {
-    return HM_OUT_OF_MEMORY;
+  struct hashmap_table *old = &hm->old;
+  for (; steps > 0 && hm->old_cursor < old->cap; steps--, hm->old_cursor++) {
+    // moved keys are left deleted so probes of the old table stay whole
+    if (hashmap_is_full(old->ctrl[hm->old_cursor])) {
+      hashmap_table_insert(&hm->table, old->slots[hm->old_cursor]);
+      old->ctrl[hm->old_cursor] = HASHMAP_CTRL_DELETED;
+      old->slots[hm->old_cursor].key = NULL;
+    }
   }
 
-  return hashmap_rehash(hm);
+  if (hm->old_cursor == old->cap) {
+    hashmap_table_free(old);
+    hm->old_cursor = 0LL;
+  }
 }
 
-enum hashmap_state hashmap_rehash(struct hashmap *hm) {
+// Bytes taken by the tables, the old one included while growing.
+size_t hashmap_bytes(struct hashmap *hm) {
   assert(hm != NULL);
-  printf("rehashing....\n");
-  hm->rehash_state = hm->rehash_state == REHASH_A ? REHASH_B : REHASH_A;
-  if (hm->rows != NULL) {
-    struct kv_entry **rows = hm->rows;
-    for (size_t ri = 0LL; ri < hm->total_rows; ri++) {
-      struct kv_entry *col = rows[ri];
-      while (col != NULL) {
-        if (col->rehash_state == hm->rehash_state) {
-          col = col->next;
-          continue;
-        }
+  return (sizeof(struct hashmap_slot) + 1) * (hm->table.cap + hm->old.cap);
+}
+
+// Slots and control bytes share one allocation, unused keys are kept NULL so
+// a control byte matched by mistake never finds one.
+void hashmap_table_init(struct hashmap_table *ht, size_t cap) {
+  assert(ht != NULL);
+  assert(cap >= HASHMAP_GROUP_WIDTH && (cap & (cap - 1)) == 0);
+  ht->slots = calloc(1, (sizeof(struct hashmap_slot) + 1) * cap);
+  assert(ht->slots != NULL);
+  ht->ctrl = (uint8_t *)(ht->slots + cap);
+  memset(ht->ctrl, HASHMAP_CTRL_EMPTY, cap);
+  ht->cap = cap;
+  ht->growth_left = cap * DEFAULT_HM_LOAD_NUM / DEFAULT_HM_LOAD_DEN;
+}
 
-        char *key = col->key;
-        uint64_t new_index = hashmap_reduce(hashmap_hash(key), hm->total_rows);
-        struct kv_entry *tmp = hm->rows[new_index];
-        struct kv_entry *place_after = NULL;
-        struct kv_entry *replace = NULL;
-        while (tmp != NULL) {
-          if (strcmp(tmp->key, key) == 0) {
-            replace = tmp;
-            break;
-          }
+void hashmap_table_free(struct hashmap_table *ht) {
+  assert(ht != NULL);
+  free(ht->slots);
+  *ht = (struct hashmap_table){.slots = NULL, .ctrl = NULL, .cap = 0LL};
+}
 
-          place_after = tmp;
-          tmp = tmp->next;
-        }
+// The key must not be in the table yet and a free slot must be left.
+void hashmap_table_insert(struct hashmap_table *ht, struct hashmap_slot slot) {
+  uint64_t hash = hashmap_key_hash(slot.key);
+  size_t at = hashmap_find_free(ht, hash);
+  if (ht->ctrl[at] == HASHMAP_CTRL_EMPTY) {
+    assert(ht->growth_left > 0);
+    ht->growth_left--;
+  }
+  ht->ctrl[at] = hashmap_h2(hash);
+  ht->slots[at] = slot;
+}
 
-        if (replace != NULL && place_after != NULL) {
-          // replace within body
-          col->next = replace->next;
-          free(replace);
-          place_after->next = col;
-        } else if (replace != NULL && place_after == NULL) {
-          // replace head
-          col->next = replace->next;
-          free(replace);
-          hm->rows[new_index] = col;
-        } else if (place_after != NULL) {
-          // insert within list body or tail
-          col->next = place_after->next;
-          place_after->next = col;
-        } else if (replace == NULL && place_after == NULL) {
-          // insert within list head
-          col->next = NULL;
-          hm->rows[new_index] = col;
-        } else {
-          return HM_INCONSISTENT_STATE;
-        }
+// A probe only goes past a group with no empty slot, so a slot in a group
+// that has one can be emptied again instead of left deleted.
+void hashmap_table_erase(struct hashmap_table *ht, size_t at) {
+  const uint8_t *group = ht->ctrl + at - at % HASHMAP_GROUP_WIDTH;
+  if (hashmap_group_empty(group) != 0) {
+    ht->ctrl[at] = HASHMAP_CTRL_EMPTY;
+    ht->growth_left++;
+  } else {
+    ht->ctrl[at] = HASHMAP_CTRL_DELETED;
+  }
+  ht->slots[at] = (struct hashmap_slot){.key = NULL, .value = VAL_NIL};
+}
 
-        col = col->next;
-      }
+// First empty or deleted slot along the probe of hash, there always is one
+// since the map grows before filling up.
+size_t hashmap_find_free(struct hashmap_table *ht, uint64_t hash) {
+  size_t mask = ht->cap / HASHMAP_GROUP_WIDTH - 1;
+  size_t gi = hashmap_h1(hash) & mask;
+  for (size_t step = 1;; step++) {
+    const uint8_t *group = ht->ctrl + gi * HASHMAP_GROUP_WIDTH;
+    uint64_t open = hashmap_group_free(group);
+    if (open != 0) {
+      return gi * HASHMAP_GROUP_WIDTH + hashmap_lane(open);
     }
+    gi = (gi + step) & mask;
   }
-
-  return HM_OK;
 }
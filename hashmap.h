@@ -1,22 +1,36 @@
 #pragma once
+#include "value.h"
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
-struct object;
-enum rehash_state { REHASH_A, REHASH_B };
-struct kv_entry {
-  struct kv_entry *next;
-  char *key;
-  struct object *value;
-  enum rehash_state rehash_state;
+// Open addressing in the style of swiss tables. Every slot has a control
+// byte, empty, deleted or the low 7 bits of the hash of its key, and whole
+// groups of control bytes are compared at once before any key is read.
+// Keys are symbols, equal keys are the same object so they hash and compare
+// by address and are owned by the symbol table rather than the map.
+struct hashmap_slot {
+  struct object *key;
+  val value;
 };
 
+struct hashmap_table {
+  struct hashmap_slot *slots;
+  uint8_t *ctrl;
+  size_t cap;
+  // slots left before the next grow, deleted ones still count as taken
+  size_t growth_left;
+};
+
+// A grow only allocates the bigger table, the keys of the old one move over
+// a few slots per operation until it is empty, lookups try both meanwhile.
+// size counts the keys of both.
 struct hashmap {
-  struct kv_entry **rows;
-  size_t total_rows;
-  size_t total_objects;
-  size_t max_objects;
-  enum rehash_state rehash_state;
+  struct hashmap_table table;
+  struct hashmap_table old;
+  size_t old_cursor;
+  size_t size;
 };
 
 enum hashmap_state {
@@ -26,18 +40,154 @@ enum hashmap_state {
   HM_INCONSISTENT_STATE,
 };
 
-#define hashmap_reduce(h, n) (h % n)
-#define DEFAULT_HM_TOTAL_ROWS 20
-#define DEFAULT_HM_MAX_OBJECTS 200
-#define DEFAULT_HM_LOAD_FACTOR 0.75f
-#define DEFAULT_HM_GROW_FACTOR 10
+#define HASHMAP_CTRL_EMPTY 0x80
+#define HASHMAP_CTRL_DELETED 0xfe
+
+// SSE2 compares 16 control bytes and gives a bit per slot, elsewhere 8 are
+// compared within a word and give the top bit of each byte.
+#if defined(__SSE2__) && !defined(HASHMAP_PORTABLE)
+#define HASHMAP_SSE2
+#include <emmintrin.h>
+#define HASHMAP_GROUP_WIDTH 16
+#define HASHMAP_LANE_BITS 1
+#else
+#define HASHMAP_GROUP_WIDTH 8
+#define HASHMAP_LANE_BITS 8
+#endif
+
+#define hashmap_h1(hash) ((hash) >> 7)
+#define hashmap_h2(hash) ((uint8_t)((hash) & 0x7f))
+#define hashmap_lane(mask) ((size_t)__builtin_ctzll(mask) / HASHMAP_LANE_BITS)
+#define hashmap_is_full(ctrl) ((ctrl) < HASHMAP_CTRL_EMPTY)
+
+// Runs block for every slot holding a key, in both tables while growing.
+#define hashmap_for_each(hm, slot, block)                                      \
+  do {                                                                         \
+    struct hashmap_table *ht = &(hm)->table;                                   \
+    for (; ht != NULL; ht = ht == &(hm)->table ? &(hm)->old : NULL) {          \
+      for (size_t hi = 0LL; hi < ht->cap; hi++) {                              \
+        if (!hashmap_is_full(ht->ctrl[hi])) {                                  \
+          continue;                                                            \
+        }                                                                      \
+        struct hashmap_slot *slot = &ht->slots[hi];                            \
+        block                                                                  \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
 
-void hashmap_init(struct hashmap *hm, size_t total_rows, size_t max_objects);
+#define DEFAULT_HM_CAP 16
+// grows once 7 of every 8 slots are taken
+#define DEFAULT_HM_LOAD_NUM 7
+#define DEFAULT_HM_LOAD_DEN 8
+// old slots moved per operation while growing, enough to empty the old table
+// well before the new one fills
+#define DEFAULT_HM_REHASH_STEP 16
+
+// Hash of chars, strings keep theirs around.
+#define hashmap_hash murmur_oaat64
+uint64_t murmur_oaat64(const char *key, size_t size);
+
+void hashmap_init(struct hashmap *hm, size_t cap);
 void hashmap_free(struct hashmap *hm);
-enum hashmap_state hashmap_put(struct hashmap *hm, char *key,
-                               struct object *value);
-enum hashmap_state hashmap_get(struct hashmap *hm, char *key,
-                               struct object **value_out);
-enum hashmap_state hashmap_del(struct hashmap *hm, char *key);
-enum hashmap_state hashmap_grow(struct hashmap *hm, size_t grow_factor);
-enum hashmap_state hashmap_rehash(struct hashmap *hm);
+enum hashmap_state hashmap_put(struct hashmap *hm, struct object *key,
+                               val value);
+enum hashmap_state hashmap_get(struct hashmap *hm, struct object *key,
+                               val *value_out);
+enum hashmap_state hashmap_del(struct hashmap *hm, struct object *key);
+enum hashmap_state hashmap_grow(struct hashmap *hm, size_t cap);
+void hashmap_rehash(struct hashmap *hm, size_t steps);
+size_t hashmap_bytes(struct hashmap *hm);
+void hashmap_table_init(struct hashmap_table *ht, size_t cap);
+void hashmap_table_free(struct hashmap_table *ht);
+void hashmap_table_insert(struct hashmap_table *ht, struct hashmap_slot slot);
+void hashmap_table_erase(struct hashmap_table *ht, size_t at);
+size_t hashmap_find_free(struct hashmap_table *ht, uint64_t hash);
+
+// Lookups are inlined into their callers, they are most of what dicts do.
+#ifdef HASHMAP_SSE2
+static inline uint64_t hashmap_group_match(const uint8_t *group,
+                                           uint8_t h2) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+}
+
+static inline uint64_t hashmap_group_empty(const uint8_t *group) {
+  __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+  return (uint16_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)HASHMAP_CTRL_EMPTY)));
+}
+
+static inline uint64_t hashmap_group_free(const uint8_t *group) {
+  // empty and deleted are the only control bytes with the top bit set
+  return (uint16_t)_mm_movemask_epi8(
+      _mm_loadu_si128((const __m128i *)group));
+}
+#else
+#define HASHMAP_LSBS 0x0101010101010101ULL
+#define HASHMAP_MSBS 0x8080808080808080ULL
+
+static inline uint64_t hashmap_group_load(const uint8_t *group) {
+  uint64_t word;
+  memcpy(&word, group, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+// Bytes equal to h2 become zero and get their top bit set by the borrow, a
+// byte right after a match may be set too, which the key compare rejects.
+static inline uint64_t hashmap_group_match(const uint8_t *group,
+                                           uint8_t h2) {
+  uint64_t word = hashmap_group_load(group) ^ (HASHMAP_LSBS * h2);
+  return (word - HASHMAP_LSBS) & ~word & HASHMAP_MSBS;
+}
+
+// Empty is the only control byte with the top bit set and the second lowest
+// clear.
+static inline uint64_t hashmap_group_empty(const uint8_t *group) {
+  uint64_t word = hashmap_group_load(group);
+  return word & ~(word << 6) & HASHMAP_MSBS;
+}
+
+static inline uint64_t hashmap_group_free(const uint8_t *group) {
+  return hashmap_group_load(group) & HASHMAP_MSBS;
+}
+#endif
+
+// Cells are 32 byte aligned, the multiply spreads the address over the high
+// bits which are folded back down for the group index and control byte.
+static inline uint64_t hashmap_key_hash(struct object *key) {
+  uint64_t hash = ((uint64_t)(uintptr_t)key >> 5) * 0x9e3779b97f4a7c15ULL;
+  return hash ^ (hash >> 32);
+}
+
+// Groups are visited in triangular steps, which covers all of them for a
+// power of two count, stopping at the first one with an empty slot.
+static inline bool hashmap_find(struct hashmap_table *ht, struct object *key,
+                                size_t *index_out) {
+  if (ht->cap == 0) {
+    return false;
+  }
+
+  uint64_t hash = hashmap_key_hash(key);
+  size_t mask = ht->cap / HASHMAP_GROUP_WIDTH - 1;
+  size_t gi = hashmap_h1(hash) & mask;
+  for (size_t step = 1;; step++) {
+    const uint8_t *group = ht->ctrl + gi * HASHMAP_GROUP_WIDTH;
+    for (uint64_t match = hashmap_group_match(group, hashmap_h2(hash));
+         match != 0; match &= match - 1) {
+      size_t at = gi * HASHMAP_GROUP_WIDTH + hashmap_lane(match);
+      if (ht->slots[at].key == key) {
+        *index_out = at;
+        return true;
+      }
+    }
+
+    if (hashmap_group_empty(group) != 0) {
+      return false;
+    }
+    gi = (gi + step) & mask;
+  }
+}
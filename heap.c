@@ -0,0 +1,115 @@
+#include "heap.h"
+#include "vm.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(sizeof(struct heap_page) <= HEAP_PAGE_HEADER_SIZE,
+               "heap page header does not fit its padding");
+_Static_assert(sizeof(struct object) >= HEAP_PAGE_MIN_CELL_SIZE,
+               "heap page mark bits do not cover every cell");
+
+void heap_init(struct heap *heap) {
+  assert(heap != NULL);
+  heap->pages = NULL;
+  heap->current = NULL;
+  heap->free_list = NULL;
+  heap->total_pages = 0LL;
+  heap->total_cells = 0LL;
+  heap->free_cells = 0LL;
+}
+
+void heap_free(struct heap *heap) {
+  assert(heap != NULL);
+  struct heap_page *page = heap->pages;
+  while (page != NULL) {
+    struct heap_page *next = page->next;
+    free(page);
+    page = next;
+  }
+
+  heap_init(heap);
+}
+
+struct heap_page *heap_page_new(struct heap *heap) {
+  assert(heap != NULL);
+  struct heap_page *page = aligned_alloc(HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+  assert(page != NULL);
+  page->used = 0LL;
+  page->swept = true;
+  memset(page->marks, 0L, sizeof(page->marks));
+  page->total =
+      (HEAP_PAGE_SIZE - HEAP_PAGE_HEADER_SIZE) / sizeof(struct object);
+
+  // newest pages go first, the current one is the only one bumped
+  page->next = heap->pages;
+  heap->pages = page;
+  heap->current = page;
+  heap->total_pages++;
+  heap->total_cells += page->total;
+  return page;
+}
+
+struct object *heap_alloc(struct heap *heap) {
+  assert(heap != NULL);
+  struct object *obj = NULL;
+  if (heap->free_list != NULL) {
+    obj = heap->free_list;
+    heap->free_list = obj->free_next;
+    heap->free_cells--;
+  } else {
+    struct heap_page *page = heap->current;
+    if (page == NULL || page->used == page->total) {
+      page = heap_page_new(heap);
+    }
+
+    obj = &heap_page_cells(page)[page->used++];
+  }
+
+  memset(obj, 0L, sizeof(struct object));
+  return obj;
+}
+
+void heap_release(struct heap *heap, struct object *obj) {
+  assert(heap != NULL);
+  assert(obj != NULL);
+  obj->flag = GC_FREE;
+  obj->free_next = heap->free_list;
+  heap->free_list = obj;
+  heap->free_cells++;
+}
+
+// Splices a chain of cells already flagged as free, linked by free_next.
+void heap_release_list(struct heap *heap, struct object *head,
+                       struct object *tail, size_t total) {
+  assert(heap != NULL);
+  if (head == NULL) {
+    return;
+  }
+
+  tail->free_next = heap->free_list;
+  heap->free_list = head;
+  heap->free_cells += total;
+}
+
+// Sets the mark bit of an old object, true when it was not set yet.
+bool heap_mark(struct object *obj) {
+  uint64_t *word = &heap_page_of(obj)->marks[heap_cell_index(obj) / 64];
+  uint64_t bit = 1ULL << (heap_cell_index(obj) % 64);
+  if (*word & bit) {
+    return false;
+  }
+
+  *word |= bit;
+  return true;
+}
+
+bool heap_mark_atomic(struct object *obj) {
+  uint64_t *word = &heap_page_of(obj)->marks[heap_cell_index(obj) / 64];
+  uint64_t bit = 1ULL << (heap_cell_index(obj) % 64);
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) {
+    return false;
+  }
+
+  return (__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit) == 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct object;
+
+#define HEAP_PAGE_SIZE (64 * 1024)
+// mark bits are sized for the smallest cell an object could ever shrink to
+#define HEAP_PAGE_MIN_CELL_SIZE 32
+#define HEAP_PAGE_MARK_WORDS (HEAP_PAGE_SIZE / HEAP_PAGE_MIN_CELL_SIZE / 64)
+
+// Pages are aligned to their own size, so the page of any cell can be found
+// by masking its address. Mark bits live in the header so collections never
+// write to the cells of surviving objects.
+struct heap_page {
+  struct heap_page *next;
+  size_t used;
+  size_t total;
+  bool swept;
+  uint64_t marks[HEAP_PAGE_MARK_WORDS];
+};
+
+struct heap {
+  struct heap_page *pages;
+  struct heap_page *current;
+  struct object *free_list;
+  size_t total_pages;
+  size_t total_cells;
+  size_t free_cells;
+};
+
+void heap_init(struct heap *heap);
+void heap_free(struct heap *heap);
+struct object *heap_alloc(struct heap *heap);
+void heap_release(struct heap *heap, struct object *obj);
+void heap_release_list(struct heap *heap, struct object *head,
+                       struct object *tail, size_t total);
+struct heap_page *heap_page_new(struct heap *heap);
+bool heap_mark(struct object *obj);
+bool heap_mark_atomic(struct object *obj);
+
+// header is padded so cells start 64 byte aligned
+#define HEAP_PAGE_HEADER_SIZE 320
+#define heap_page_of(obj)                                                      \
+  ((struct heap_page *)((uintptr_t)(obj) & ~((uintptr_t)HEAP_PAGE_SIZE - 1)))
+#define heap_page_cells(page)                                                  \
+  ((struct object *)((char *)(page) + HEAP_PAGE_HEADER_SIZE))
+#define heap_cell_index(obj)                                                   \
+  ((size_t)((obj) - heap_page_cells(heap_page_of(obj))))
+#define heap_is_marked(obj)                                                    \
+  ((heap_page_of(obj)->marks[heap_cell_index(obj) / 64] >>                     \
+    (heap_cell_index(obj) % 64)) &                                             \
+   1)
+
+#define heap_for_each(heap, obj, block)                                        \
+  do {                                                                         \
+    struct heap_page *page = (heap)->pages;                                    \
+    while (page != NULL) {                                                     \
+      struct object *cells = heap_page_cells(page);                            \
+      for (size_t ci = 0LL; ci < page->used; ci++) {                           \
+        struct object *obj = &cells[ci];                                       \
+        block                                                                  \
+      }                                                                        \
+      page = page->next;                                                       \
+    }                                                                          \
+  } while (0)
@@ -0,0 +1,660 @@
+#include "kernels.h"
+#include "binops.h"
+#include "vm.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs a recognized fold over a packed list at once when the carry has the
+// type of its items, returns false to leave it to the bytecode loop. Float
+// sums and products keep adding in order so they round just like the loop,
+// float min and max are left to it since which NaN or zero they keep depends
+// on how the comparison was written.
+bool list_reduce(struct vm *vm, enum reduce_op op, struct object *list,
+                 val init, val *res_out) {
+  assert(vm != NULL);
+  assert(list != NULL);
+  assert(list->type == TYPE_LIST);
+  size_t size = list->list.size;
+  enum object_type type = val_type(init);
+
+  if (op == REDUCE_COUNT) {
+    if (type != TYPE_I64) {
+      return false;
+    }
+
+    *res_out = vm_i64(vm, (int64_t)(val_u64(init) + size));
+    return true;
+  }
+
+  if (list->list_kind == LIST_I64 && type == TYPE_I64) {
+    int64_t carry = val_i64(init);
+    const int64_t *items = list->list.i64s;
+    const uint64_t *bits = list->list.u64s;
+    int64_t res = 0;
+    switch (op) {
+    case REDUCE_SUM:
+      res = (int64_t)kernel_sum_u64(carry, bits, size);
+      break;
+    case REDUCE_PRODUCT:
+      res = (int64_t)kernel_product_u64(carry, bits, size);
+      break;
+    case REDUCE_BIT_AND:
+    case REDUCE_BIT_OR:
+    case REDUCE_BIT_XOR:
+      res = (int64_t)kernel_bits_u64(op, carry, bits, size);
+      break;
+    case REDUCE_ALL:
+      res = carry && kernel_zeros_u64(bits, size) == 0;
+      break;
+    case REDUCE_ANY:
+      res = carry || kernel_zeros_u64(bits, size) < size;
+      break;
+    case REDUCE_MIN:
+      res = kernel_min_i64(carry, items, size);
+      break;
+    case REDUCE_MAX:
+      res = kernel_max_i64(carry, items, size);
+      break;
+    case REDUCE_COUNT:
+      return false;
+    }
+
+    *res_out = vm_i64(vm, res);
+    return true;
+  }
+
+  if (list->list_kind == LIST_U64 && type == TYPE_U64) {
+    uint64_t carry = val_u64(init);
+    const uint64_t *items = list->list.u64s;
+    uint64_t res = 0;
+    switch (op) {
+    case REDUCE_SUM:
+      res = kernel_sum_u64(carry, items, size);
+      break;
+    case REDUCE_PRODUCT:
+      res = kernel_product_u64(carry, items, size);
+      break;
+    case REDUCE_BIT_AND:
+    case REDUCE_BIT_OR:
+    case REDUCE_BIT_XOR:
+      res = kernel_bits_u64(op, carry, items, size);
+      break;
+    case REDUCE_ALL:
+      res = carry && kernel_zeros_u64(items, size) == 0;
+      break;
+    case REDUCE_ANY:
+      res = carry || kernel_zeros_u64(items, size) < size;
+      break;
+    case REDUCE_MIN:
+      res = kernel_min_u64(carry, items, size);
+      break;
+    case REDUCE_MAX:
+      res = kernel_max_u64(carry, items, size);
+      break;
+    case REDUCE_COUNT:
+      return false;
+    }
+
+    *res_out = vm_u64(vm, res);
+    return true;
+  }
+
+  if (list->list_kind == LIST_F64 && type == TYPE_F64) {
+    double carry = val_as_f64(init);
+    const double *items = list->list.f64s;
+    double res = carry;
+    switch (op) {
+    case REDUCE_SUM:
+      for (size_t ii = 0LL; ii < size; ii++) {
+        res += items[ii];
+      }
+      break;
+    case REDUCE_PRODUCT:
+      for (size_t ii = 0LL; ii < size; ii++) {
+        res *= items[ii];
+      }
+      break;
+    case REDUCE_ALL:
+      res = carry && kernel_zeros_f64(items, size) == 0;
+      break;
+    case REDUCE_ANY:
+      res = carry || kernel_zeros_f64(items, size) < size;
+      break;
+    default:
+      return false;
+    }
+
+    *res_out = val_from_f64(res);
+    return true;
+  }
+
+  return false;
+}
+
+// Combines two lists of the same kind, or one and a scalar of the type of its
+// items, into a packed list of that kind just like the scalar handlers would
+// item by item. Returns false for anything else, which goes item by item.
+bool list_map(struct vm *vm, val left, val right, enum bin_op op,
+              val *res_out) {
+  assert(vm != NULL);
+  enum list_kind kind = list_map_kind(left);
+  if (kind == LIST_VALUES || list_map_kind(right) != kind) {
+    return false;
+  }
+
+  if (kind == LIST_F64 &&
+      (op == OP_MOD || op == OP_AND || op == OP_OR || op == OP_XOR)) {
+    return false;
+  }
+
+  struct object *res = binop_alloc(vm, &left, &right);
+  bool left_list = val_type(left) == TYPE_LIST;
+  bool right_list = val_type(right) == TYPE_LIST;
+  struct object *list = val_as_obj(left_list ? left : right);
+  res->type = TYPE_LIST;
+  res->list_kind = kind;
+  res->list.size = list->list.size;
+  res->list.items = malloc(sizeof(val) * res->list.size);
+  vm->gc.allocated += sizeof(val) * res->list.size;
+
+  // scalars are read from a local and repeated with a step of 0
+  switch (kind) {
+  case LIST_I64: {
+    int64_t scalars[2] = {0};
+    if (!left_list) {
+      scalars[0] = val_i64(left);
+    }
+
+    if (!right_list) {
+      scalars[1] = val_i64(right);
+    }
+
+    kernel_map_i64(op, res->list.i64s,
+                   left_list ? val_as_obj(left)->list.i64s : &scalars[0],
+                   left_list,
+                   right_list ? val_as_obj(right)->list.i64s : &scalars[1],
+                   right_list, res->list.size);
+    break;
+  }
+  case LIST_U64: {
+    uint64_t scalars[2] = {0};
+    if (!left_list) {
+      scalars[0] = val_u64(left);
+    }
+
+    if (!right_list) {
+      scalars[1] = val_u64(right);
+    }
+
+    kernel_map_u64(op, res->list.u64s,
+                   left_list ? val_as_obj(left)->list.u64s : &scalars[0],
+                   left_list,
+                   right_list ? val_as_obj(right)->list.u64s : &scalars[1],
+                   right_list, res->list.size);
+    break;
+  }
+  case LIST_F64: {
+    double scalars[2] = {0};
+    if (!left_list) {
+      scalars[0] = val_as_f64(left);
+    }
+
+    if (!right_list) {
+      scalars[1] = val_as_f64(right);
+    }
+
+    kernel_map_f64(op, res->list.f64s,
+                   left_list ? val_as_obj(left)->list.f64s : &scalars[0],
+                   left_list,
+                   right_list ? val_as_obj(right)->list.f64s : &scalars[1],
+                   right_list, res->list.size);
+    break;
+  }
+  case LIST_VALUES:
+    break;
+  }
+
+  *res_out = val_from_obj(res);
+  return true;
+}
+
+// Kind of the items a list operand holds or the one a scalar would pack to.
+enum list_kind list_map_kind(val operand) {
+  switch (val_type(operand)) {
+  case TYPE_LIST:
+    return val_as_obj(operand)->list_kind;
+  case TYPE_I64:
+    return LIST_I64;
+  case TYPE_U64:
+    return LIST_U64;
+  case TYPE_F64:
+    return LIST_F64;
+  default:
+    return LIST_VALUES;
+  }
+}
+
+// Every kernel below keeps one partial result per lane, folds the lanes
+// together at the end and then the items left over the last whole vector.
+
+uint64_t kernel_sum_u64(uint64_t init, const uint64_t *items, size_t size) {
+  uint64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_u64s acc = {0};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc += item;
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res += acc[li];
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res += items[ii];
+  }
+
+  return res;
+}
+
+uint64_t kernel_product_u64(uint64_t init, const uint64_t *items,
+                            size_t size) {
+  uint64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_u64s acc = {1, 1, 1, 1};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc *= item;
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res *= acc[li];
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res *= items[ii];
+  }
+
+  return res;
+}
+
+uint64_t kernel_bits_u64(enum reduce_op op, uint64_t init,
+                         const uint64_t *items, size_t size) {
+  assert(op == REDUCE_BIT_AND || op == REDUCE_BIT_OR || op == REDUCE_BIT_XOR);
+  uint64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  uint64_t identity = op == REDUCE_BIT_AND ? ~0ULL : 0ULL;
+  kernel_u64s acc = {identity, identity, identity, identity};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    if (op == REDUCE_BIT_AND) {
+      acc &= item;
+    } else if (op == REDUCE_BIT_OR) {
+      acc |= item;
+    } else {
+      acc ^= item;
+    }
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res = op == REDUCE_BIT_AND ? res & acc[li]
+          : op == REDUCE_BIT_OR ? res | acc[li]
+                                : res ^ acc[li];
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res = op == REDUCE_BIT_AND ? res & items[ii]
+          : op == REDUCE_BIT_OR ? res | items[ii]
+                                : res ^ items[ii];
+  }
+
+  return res;
+}
+
+size_t kernel_zeros_u64(const uint64_t *items, size_t size) {
+  size_t res = 0LL;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  // comparisons give -1 in the lanes that hold
+  kernel_i64s acc = {0};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc -= item == 0;
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res += acc[li];
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res += items[ii] == 0;
+  }
+
+  return res;
+}
+
+size_t kernel_zeros_f64(const double *items, size_t size) {
+  size_t res = 0LL;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_i64s acc = {0};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_f64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc -= item == 0.0;
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res += acc[li];
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res += items[ii] == 0.0;
+  }
+
+  return res;
+}
+
+// C has no vector ?:, lanes are picked through the all ones comparison mask
+#define kernel_select(mask, then, otherwise)                                   \
+  (((then) & (mask)) | ((otherwise) & ~(mask)))
+
+int64_t kernel_min_i64(int64_t init, const int64_t *items, size_t size) {
+  int64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_i64s acc = {init, init, init, init};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_i64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc = kernel_select(item < acc, item, acc);
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res = acc[li] < res ? acc[li] : res;
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res = items[ii] < res ? items[ii] : res;
+  }
+
+  return res;
+}
+
+int64_t kernel_max_i64(int64_t init, const int64_t *items, size_t size) {
+  int64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_i64s acc = {init, init, init, init};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_i64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc = kernel_select(item > acc, item, acc);
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res = acc[li] > res ? acc[li] : res;
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res = items[ii] > res ? items[ii] : res;
+  }
+
+  return res;
+}
+
+uint64_t kernel_min_u64(uint64_t init, const uint64_t *items, size_t size) {
+  uint64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_u64s acc = {init, init, init, init};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc = kernel_select((kernel_u64s)(item < acc), item, acc);
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res = acc[li] < res ? acc[li] : res;
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res = items[ii] < res ? items[ii] : res;
+  }
+
+  return res;
+}
+
+uint64_t kernel_max_u64(uint64_t init, const uint64_t *items, size_t size) {
+  uint64_t res = init;
+  size_t ii = 0LL;
+#ifdef KERNELS_SIMD
+  kernel_u64s acc = {init, init, init, init};
+  for (; ii + KERNELS_LANES <= size; ii += KERNELS_LANES) {
+    kernel_u64s item;
+    memcpy(&item, items + ii, sizeof(item));
+    acc = kernel_select((kernel_u64s)(item > acc), item, acc);
+  }
+
+  for (size_t li = 0LL; li < KERNELS_LANES; li++) {
+    res = acc[li] > res ? acc[li] : res;
+  }
+#endif
+
+  for (; ii < size; ii++) {
+    res = items[ii] > res ? items[ii] : res;
+  }
+
+  return res;
+}
+
+// Runs expr over a and b for every item, going through whole vectors first
+// when the operator means the same on them. Relies on the parameters of the
+// kernel_map functions.
+#ifdef KERNELS_SIMD
+#define kernel_map_lanes(type, vector, expr)                                   \
+  do {                                                                         \
+    size_t ki = 0LL;                                                           \
+    vector left_lanes = (vector){0} + left[0];                                 \
+    vector right_lanes = (vector){0} + right[0];                               \
+    for (; ki + KERNELS_LANES <= size; ki += KERNELS_LANES) {                  \
+      vector a = left_lanes;                                                   \
+      vector b = right_lanes;                                                  \
+      if (left_step != 0) {                                                    \
+        memcpy(&a, left + ki, sizeof(a));                                      \
+      }                                                                        \
+      if (right_step != 0) {                                                   \
+        memcpy(&b, right + ki, sizeof(b));                                     \
+      }                                                                        \
+      vector res = (expr);                                                     \
+      memcpy(out + ki, &res, sizeof(res));                                     \
+    }                                                                          \
+    for (; ki < size; ki++) {                                                  \
+      type a = left[ki * left_step];                                           \
+      type b = right[ki * right_step];                                         \
+      out[ki] = (expr);                                                        \
+    }                                                                          \
+  } while (0)
+#else
+#define kernel_map_lanes(type, vector, expr) kernel_map_items(type, expr)
+#endif
+
+#define kernel_map_items(type, expr)                                           \
+  do {                                                                         \
+    for (size_t ki = 0LL; ki < size; ki++) {                                   \
+      type a = left[ki * left_step];                                           \
+      type b = right[ki * right_step];                                         \
+      out[ki] = (expr);                                                        \
+    }                                                                          \
+  } while (0)
+
+void kernel_map_i64(enum bin_op op, int64_t *out, const int64_t *left,
+                    size_t left_step, const int64_t *right, size_t right_step,
+                    size_t size) {
+  switch (op) {
+  case OP_ADD:
+    kernel_map_lanes(int64_t, kernel_i64s, a + b);
+    break;
+  case OP_SUB:
+    kernel_map_lanes(int64_t, kernel_i64s, a - b);
+    break;
+  case OP_MUL:
+    kernel_map_lanes(int64_t, kernel_i64s, a * b);
+    break;
+  case OP_AND:
+    kernel_map_lanes(int64_t, kernel_i64s, a & b);
+    break;
+  case OP_OR:
+    kernel_map_lanes(int64_t, kernel_i64s, a | b);
+    break;
+  case OP_XOR:
+    kernel_map_lanes(int64_t, kernel_i64s, a ^ b);
+    break;
+  case OP_DIV:
+    kernel_map_items(int64_t, a / b);
+    break;
+  case OP_MOD:
+    kernel_map_items(int64_t, a % b);
+    break;
+  case OP_ANDS:
+    kernel_map_items(int64_t, a && b);
+    break;
+  case OP_ORS:
+    kernel_map_items(int64_t, a || b);
+    break;
+  case OP_EQ:
+    kernel_map_items(int64_t, a == b);
+    break;
+  case OP_NEQ:
+    kernel_map_items(int64_t, a != b);
+    break;
+  case OP_LT:
+    kernel_map_items(int64_t, a < b);
+    break;
+  case OP_LE:
+    kernel_map_items(int64_t, a <= b);
+    break;
+  case OP_GT:
+    kernel_map_items(int64_t, a > b);
+    break;
+  case OP_GE:
+    kernel_map_items(int64_t, a >= b);
+    break;
+  }
+}
+
+void kernel_map_u64(enum bin_op op, uint64_t *out, const uint64_t *left,
+                    size_t left_step, const uint64_t *right,
+                    size_t right_step, size_t size) {
+  switch (op) {
+  case OP_ADD:
+    kernel_map_lanes(uint64_t, kernel_u64s, a + b);
+    break;
+  case OP_SUB:
+    kernel_map_lanes(uint64_t, kernel_u64s, a - b);
+    break;
+  case OP_MUL:
+    kernel_map_lanes(uint64_t, kernel_u64s, a * b);
+    break;
+  case OP_AND:
+    kernel_map_lanes(uint64_t, kernel_u64s, a & b);
+    break;
+  case OP_OR:
+    kernel_map_lanes(uint64_t, kernel_u64s, a | b);
+    break;
+  case OP_XOR:
+    kernel_map_lanes(uint64_t, kernel_u64s, a ^ b);
+    break;
+  case OP_DIV:
+    kernel_map_items(uint64_t, a / b);
+    break;
+  case OP_MOD:
+    kernel_map_items(uint64_t, a % b);
+    break;
+  case OP_ANDS:
+    kernel_map_items(uint64_t, a && b);
+    break;
+  case OP_ORS:
+    kernel_map_items(uint64_t, a || b);
+    break;
+  case OP_EQ:
+    kernel_map_items(uint64_t, a == b);
+    break;
+  case OP_NEQ:
+    kernel_map_items(uint64_t, a != b);
+    break;
+  case OP_LT:
+    kernel_map_items(uint64_t, a < b);
+    break;
+  case OP_LE:
+    kernel_map_items(uint64_t, a <= b);
+    break;
+  case OP_GT:
+    kernel_map_items(uint64_t, a > b);
+    break;
+  case OP_GE:
+    kernel_map_items(uint64_t, a >= b);
+    break;
+  }
+}
+
+void kernel_map_f64(enum bin_op op, double *out, const double *left,
+                    size_t left_step, const double *right, size_t right_step,
+                    size_t size) {
+  switch (op) {
+  case OP_ADD:
+    kernel_map_lanes(double, kernel_f64s, a + b);
+    break;
+  case OP_SUB:
+    kernel_map_lanes(double, kernel_f64s, a - b);
+    break;
+  case OP_MUL:
+    kernel_map_lanes(double, kernel_f64s, a * b);
+    break;
+  case OP_DIV:
+    kernel_map_lanes(double, kernel_f64s, a / b);
+    break;
+  case OP_ANDS:
+    kernel_map_items(double, a && b);
+    break;
+  case OP_ORS:
+    kernel_map_items(double, a || b);
+    break;
+  case OP_EQ:
+    kernel_map_items(double, a == b);
+    break;
+  case OP_NEQ:
+    kernel_map_items(double, a != b);
+    break;
+  case OP_LT:
+    kernel_map_items(double, a < b);
+    break;
+  case OP_LE:
+    kernel_map_items(double, a <= b);
+    break;
+  case OP_GT:
+    kernel_map_items(double, a > b);
+    break;
+  case OP_GE:
+    kernel_map_items(double, a >= b);
+    break;
+  default:
+    assert(false && "no f64 kernel for the operator");
+  }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "vm.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Loops over the unboxed items of packed lists. They are written with the
+// vector types of GCC and clang so the compiler lowers them to whatever SIMD
+// the target has, other compilers get the plain scalar loops.
+#if defined(__GNUC__) && !defined(KERNELS_SCALAR)
+#define KERNELS_SIMD
+#define KERNELS_LANES 4
+typedef int64_t kernel_i64s
+    __attribute__((vector_size(KERNELS_LANES * sizeof(int64_t))));
+typedef uint64_t kernel_u64s
+    __attribute__((vector_size(KERNELS_LANES * sizeof(uint64_t))));
+typedef double kernel_f64s
+    __attribute__((vector_size(KERNELS_LANES * sizeof(double))));
+#endif
+
+bool list_reduce(struct vm *vm, enum reduce_op op, struct object *list,
+                 val init, val *res_out);
+bool list_map(struct vm *vm, val left, val right, enum bin_op op,
+              val *res_out);
+enum list_kind list_map_kind(val operand);
+
+// i64 and u64 share the wrapping kernels, their bits come out the same
+uint64_t kernel_sum_u64(uint64_t init, const uint64_t *items, size_t size);
+uint64_t kernel_product_u64(uint64_t init, const uint64_t *items, size_t size);
+uint64_t kernel_bits_u64(enum reduce_op op, uint64_t init,
+                         const uint64_t *items, size_t size);
+size_t kernel_zeros_u64(const uint64_t *items, size_t size);
+int64_t kernel_min_i64(int64_t init, const int64_t *items, size_t size);
+int64_t kernel_max_i64(int64_t init, const int64_t *items, size_t size);
+uint64_t kernel_min_u64(uint64_t init, const uint64_t *items, size_t size);
+uint64_t kernel_max_u64(uint64_t init, const uint64_t *items, size_t size);
+size_t kernel_zeros_f64(const double *items, size_t size);
+
+// steps are 1 for lists and 0 for a scalar repeated over every item
+void kernel_map_i64(enum bin_op op, int64_t *out, const int64_t *left,
+                    size_t left_step, const int64_t *right, size_t right_step,
+                    size_t size);
+void kernel_map_u64(enum bin_op op, uint64_t *out, const uint64_t *left,
+                    size_t left_step, const uint64_t *right,
+                    size_t right_step, size_t size);
+void kernel_map_f64(enum bin_op op, double *out, const double *left,
+                    size_t left_step, const double *right, size_t right_step,
+                    size_t size);
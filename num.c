@@ -0,0 +1,276 @@
+#include "num.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+double num_pow10(size_t exp) {
+  static const double pow10[NUM_F64_EXACT_POW10 + 1] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+  assert(exp <= NUM_F64_EXACT_POW10);
+  return pow10[exp];
+}
+
+// Digits are written two at a time from the end of a scratch buffer.
+size_t num_format_u64(char *out, uint64_t u64) {
+  static const char pairs[] = "00010203040506070809"
+                              "10111213141516171819"
+                              "20212223242526272829"
+                              "30313233343536373839"
+                              "40414243444546474849"
+                              "50515253545556575859"
+                              "60616263646566676869"
+                              "70717273747576777879"
+                              "80818283848586878889"
+                              "90919293949596979899";
+  char digits[NUM_CHARS_MAX];
+  size_t at = NUM_CHARS_MAX;
+  while (u64 >= 100) {
+    size_t pair = (u64 % 100) * 2;
+    u64 /= 100;
+    digits[--at] = pairs[pair + 1];
+    digits[--at] = pairs[pair];
+  }
+
+  if (u64 >= 10) {
+    digits[--at] = pairs[u64 * 2 + 1];
+    digits[--at] = pairs[u64 * 2];
+  } else {
+    digits[--at] = (char)('0' + u64);
+  }
+
+  size_t size = NUM_CHARS_MAX - at;
+  memcpy(out, digits + at, size);
+  out[size] = '\0';
+  return size;
+}
+
+size_t num_format_i64(char *out, int64_t i64) {
+  if (i64 >= 0) {
+    return num_format_u64(out, (uint64_t)i64);
+  }
+
+  out[0] = '-';
+  return num_format_u64(out + 1, 0ULL - (uint64_t)i64) + 1;
+}
+
+// Floats always show a point or an exponent so they read back as floats.
+size_t num_format_f64(char *out, double f64) {
+  if (isnan(f64)) {
+    memcpy(out, "nan", 4);
+    return 3;
+  }
+
+  if (isinf(f64)) {
+    const char *chars = f64 < 0 ? "-inf" : "inf";
+    memcpy(out, chars, strlen(chars) + 1);
+    return strlen(chars);
+  }
+
+  size_t size = 0LL;
+  if (num_format_f64_exact(out, f64, &size)) {
+    return size;
+  }
+
+  // the rest go through libc trying each precision, 17 digits always do
+  for (int precision = 15; precision <= 17; precision++) {
+    size = snprintf(out, NUM_CHARS_MAX, "%.*g", precision, f64);
+    if (strtod(out, NULL) == f64) {
+      break;
+    }
+  }
+
+  if (strpbrk(out, ".e") == NULL) {
+    memcpy(out + size, ".0", 3);
+    size += 2;
+  }
+  return size;
+}
+
+// Finds the fewest decimals d such that f64 * 10^d rounds to an integer n
+// that gives back f64 when divided by 10^d. Both n and 10^d are exact
+// doubles, so the division rounds the same as parsing the chars would.
+bool num_format_f64_exact(char *out, double f64, size_t *size_out) {
+  double magnitude = fabs(f64);
+  if (magnitude >= (double)NUM_F64_EXACT_INT) {
+    return false;
+  }
+
+  for (size_t decimals = 0LL; decimals <= NUM_F64_EXACT_POW10; decimals++) {
+    double scaled = round(magnitude * num_pow10(decimals));
+    if (scaled >= (double)NUM_F64_EXACT_INT) {
+      return false;
+    }
+
+    if (scaled / num_pow10(decimals) == magnitude) {
+      *size_out =
+          num_format_fixed(out, (uint64_t)scaled, decimals, signbit(f64));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Writes digits with a point before the last decimals of them.
+size_t num_format_fixed(char *out, uint64_t digits, size_t decimals,
+                        bool negative) {
+  char chars[NUM_CHARS_MAX];
+  size_t chars_size = num_format_u64(chars, digits);
+  size_t size = 0LL;
+  if (negative) {
+    out[size++] = '-';
+  }
+
+  if (chars_size <= decimals) {
+    out[size++] = '0';
+    out[size++] = '.';
+    memset(out + size, '0', decimals - chars_size);
+    size += decimals - chars_size;
+    memcpy(out + size, chars, chars_size);
+    size += chars_size;
+  } else {
+    size_t whole = chars_size - decimals;
+    memcpy(out + size, chars, whole);
+    size += whole;
+    out[size++] = '.';
+    if (decimals == 0) {
+      out[size++] = '0';
+    } else {
+      memcpy(out + size, chars + whole, decimals);
+      size += decimals;
+    }
+  }
+
+  out[size] = '\0';
+  return size;
+}
+
+// Reads the longest number at the start of chars and returns how many chars
+// it took, 0 when there is none. Integers are i64 when they fit, then u64,
+// then f64. Floats whose digits make an integer up to 2^53 and whose power of
+// ten is exact take one multiply or divide, which is correctly rounded, the
+// rest are handed to strtod.
+size_t num_parse(const char *chars, size_t size, struct num *out) {
+  assert(chars != NULL);
+  assert(out != NULL);
+  out->type = NUM_INVALID;
+  out->i64 = 0LL;
+
+  size_t at = 0LL;
+  bool negative = false;
+  if (at < size && (chars[at] == '-' || chars[at] == '+')) {
+    negative = chars[at] == '-';
+    at++;
+  }
+
+  uint64_t mantissa = 0ULL;
+  size_t digits = 0LL;
+  bool truncated = false;
+  int64_t exp = 0LL;
+  for (; at < size && chars[at] >= '0' && chars[at] <= '9'; at++) {
+    if (num_digit_fits(mantissa, chars[at])) {
+      mantissa = mantissa * 10 + (uint64_t)(chars[at] - '0');
+    } else {
+      truncated = true;
+      exp++;
+    }
+    digits++;
+  }
+
+  bool is_float = false;
+  if (at < size && chars[at] == '.') {
+    is_float = true;
+    for (at++; at < size && chars[at] >= '0' && chars[at] <= '9'; at++) {
+      if (num_digit_fits(mantissa, chars[at])) {
+        mantissa = mantissa * 10 + (uint64_t)(chars[at] - '0');
+        exp--;
+      } else {
+        truncated = true;
+      }
+      digits++;
+    }
+  }
+
+  if (digits == 0) {
+    return 0LL;
+  }
+
+  if (at < size && (chars[at] == 'e' || chars[at] == 'E')) {
+    size_t exp_at = at + 1;
+    bool exp_negative = false;
+    if (exp_at < size && (chars[exp_at] == '-' || chars[exp_at] == '+')) {
+      exp_negative = chars[exp_at] == '-';
+      exp_at++;
+    }
+
+    int64_t exp_value = 0LL;
+    size_t exp_digits = 0LL;
+    for (; exp_at < size && chars[exp_at] >= '0' && chars[exp_at] <= '9';
+         exp_at++) {
+      if (exp_value < 100000) {
+        exp_value = exp_value * 10 + (chars[exp_at] - '0');
+      }
+      exp_digits++;
+    }
+
+    // a bare e is not part of the number
+    if (exp_digits > 0) {
+      is_float = true;
+      exp += exp_negative ? -exp_value : exp_value;
+      at = exp_at;
+    }
+  }
+
+  if (!is_float && !truncated) {
+    if (!negative && mantissa <= INT64_MAX) {
+      out->type = NUM_I64;
+      out->i64 = (int64_t)mantissa;
+      return at;
+    }
+
+    if (!negative) {
+      out->type = NUM_U64;
+      out->u64 = mantissa;
+      return at;
+    }
+
+    if (mantissa <= (uint64_t)INT64_MAX + 1) {
+      out->type = NUM_I64;
+      out->i64 = (int64_t)(0ULL - mantissa);
+      return at;
+    }
+  }
+
+  out->type = NUM_F64;
+  if (!truncated && mantissa <= NUM_F64_EXACT_INT &&
+      exp >= -NUM_F64_EXACT_POW10 && exp <= NUM_F64_EXACT_POW10) {
+    double f64 = (double)mantissa;
+    f64 = exp < 0 ? f64 / num_pow10(-exp) : f64 * num_pow10(exp);
+    out->f64 = negative ? -f64 : f64;
+    return at;
+  }
+
+  out->f64 = num_parse_f64_slow(chars, at);
+  return at;
+}
+
+bool num_digit_fits(uint64_t mantissa, char digit) {
+  return mantissa < UINT64_MAX / 10 ||
+         (mantissa == UINT64_MAX / 10 &&
+          (uint64_t)(digit - '0') <= UINT64_MAX % 10);
+}
+
+// chars may not end where the number does, strtod gets a terminated copy.
+double num_parse_f64_slow(const char *chars, size_t size) {
+  char *copy = malloc(size + 1);
+  assert(copy != NULL);
+  memcpy(copy, chars, size);
+  copy[size] = '\0';
+  double f64 = strtod(copy, NULL);
+  free(copy);
+  return f64;
+}
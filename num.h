@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Numbers to chars and back without going through the locale aware stdio,
+// floats come out as the shortest chars reading back to the same double.
+enum num_type { NUM_INVALID, NUM_I64, NUM_U64, NUM_F64 };
+struct num {
+  enum num_type type;
+  union {
+    int64_t i64;
+    uint64_t u64;
+    double f64;
+  };
+};
+
+// Longest formatted number plus its NUL terminator.
+#define NUM_CHARS_MAX 40
+// Doubles hold integers exactly up to here and powers of ten up to 10^22.
+#define NUM_F64_EXACT_INT (1ULL << 53)
+#define NUM_F64_EXACT_POW10 22
+
+double num_pow10(size_t exp);
+size_t num_format_u64(char *out, uint64_t u64);
+size_t num_format_i64(char *out, int64_t i64);
+size_t num_format_f64(char *out, double f64);
+bool num_format_f64_exact(char *out, double f64, size_t *size_out);
+size_t num_format_fixed(char *out, uint64_t digits, size_t decimals,
+                        bool negative);
+size_t num_parse(const char *chars, size_t size, struct num *out);
+bool num_digit_fits(uint64_t mantissa, char digit);
+double num_parse_f64_slow(const char *chars, size_t size);
@@ -225,13 +225,27 @@ dict_expr: T_LCB dict_items T_RCB         { $$ = $2; }
 lambda_expr: T_LAMBDA def_params T_ASSIGN expr { $$ = make_lambda_expr($2, $4); }
 
 %%
-int main() {
+int main(int argc, char **argv) {
   struct vm vm;
   vm_init(&vm);
 
+  // options given in the command line override the environment
+  gc_configure_env(&vm.gc);
+  for (int ai = 1; ai < argc; ai++) {
+    if (!gc_configure_arg(&vm.gc, argv[ai])) {
+      fprintf(stderr, "unknown option: %s\n", argv[ai]);
+      vm_free(&vm);
+      return 1;
+    }
+  }
+
   int res = yyparse(&vm);
-  struct object *result = vm_run_main(&vm);
-  object_print(result, true);
+  val result = vm_run_main(&vm);
+  val_print(result, true);
+
+  if (vm.gc.print_stats) {
+    gc_print_stats(&vm.gc, stderr);
+  }
 
   vm_free(&vm);
   return res;
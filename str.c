@@ -0,0 +1,59 @@
+#include "str.h"
+#include "hashmap.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Chars are left for the caller to fill, only the terminator is set.
+struct string *string_alloc(size_t size) {
+  struct string *string = malloc(string_bytes(size));
+  assert(string != NULL);
+  string->size = size;
+  string->hash = STRING_HASH_UNSET;
+  string->chars[size] = '\0';
+  return string;
+}
+
+struct string *string_concat(const char *left, size_t left_size,
+                             const char *right, size_t right_size) {
+  struct string *string = string_alloc(left_size + right_size);
+  memcpy(string->chars, left, left_size);
+  if (right_size > 0) {
+    memcpy(string->chars + left_size, right, right_size);
+  }
+  return string;
+}
+
+uint64_t string_hash(struct string *string) {
+  assert(string != NULL);
+  if (string->hash == STRING_HASH_UNSET) {
+    string->hash = string_hash_chars(string->chars, string->size);
+  }
+
+  return string->hash;
+}
+
+uint64_t string_hash_chars(const char *chars, size_t size) {
+  // the unset mark is taken, strings hashing to it share a neighbour
+  uint64_t hash = hashmap_hash(chars, size);
+  return hash == STRING_HASH_UNSET ? hash + 1 : hash;
+}
+
+bool string_equals(struct string *left, struct string *right) {
+  assert(left != NULL);
+  assert(right != NULL);
+  if (left == right) {
+    return true;
+  }
+
+  if (left->size != right->size) {
+    return false;
+  }
+
+  if (left->hash != STRING_HASH_UNSET && right->hash != STRING_HASH_UNSET &&
+      left->hash != right->hash) {
+    return false;
+  }
+
+  return memcmp(left->chars, right->chars, left->size) == 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Strings never change once made, their size is kept next to the chars,
+// which are still NUL terminated for printf, and their hash is computed the
+// first time a dict asks for it.
+struct string {
+  size_t size;
+  uint64_t hash;
+  char chars[];
+};
+
+#define STRING_HASH_UNSET 0ULL
+// bytes taken by a string of size chars
+#define string_bytes(size) (sizeof(struct string) + (size) + 1)
+
+struct string *string_alloc(size_t size);
+struct string *string_concat(const char *left, size_t left_size,
+                             const char *right, size_t right_size);
+uint64_t string_hash(struct string *string);
+uint64_t string_hash_chars(const char *chars, size_t size);
+bool string_equals(struct string *left, struct string *right);
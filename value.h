@@ -0,0 +1,59 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+struct object;
+
+// Values are 64 bit words telling their own type, only strings, errors,
+// pairs, lists, dicts, functions and integers too wide for 48 bits live in
+// the heap:
+//   0000 pppp pppp pppp  object address, or one of the constants below
+//   0002 .... fff2 ....  f64 with its bits offset by 2^49
+//   fffe uuuu uuuu uuuu  u64 up to 48 bits
+//   ffff iiii iiii iiii  i64 of 48 bits, sign extended
+// NaNs are made canonical first so no f64 reaches the integer prefixes.
+typedef uint64_t val;
+
+#define VAL_NULL 0x0ULL
+#define VAL_NIL 0x2ULL
+#define VAL_UNIT 0x4ULL
+#define VAL_FALSE 0x6ULL
+#define VAL_TRUE 0x7ULL
+#define VAL_F64_OFFSET (1ULL << 49)
+#define VAL_F64_NAN 0x7ff8000000000000ULL
+#define VAL_TAG_U64 0xfffe000000000000ULL
+#define VAL_TAG_I64 0xffff000000000000ULL
+#define VAL_TAG_MASK 0xffff000000000000ULL
+#define VAL_INT_BITS 48
+#define VAL_I64_MIN (-(1LL << (VAL_INT_BITS - 1)))
+#define VAL_I64_MAX ((1LL << (VAL_INT_BITS - 1)) - 1)
+#define VAL_U64_MAX ((1ULL << VAL_INT_BITS) - 1)
+
+#define val_is_obj(v) (((v) & VAL_TAG_MASK) == 0 && (v) > VAL_TRUE)
+#define val_is_f64(v) ((v) >= VAL_F64_OFFSET && (v) < VAL_TAG_U64)
+#define val_is_small_i64(v) (((v) & VAL_TAG_MASK) == VAL_TAG_I64)
+#define val_is_small_u64(v) (((v) & VAL_TAG_MASK) == VAL_TAG_U64)
+#define val_as_obj(v) ((struct object *)(uintptr_t)(v))
+#define val_from_obj(obj) ((val)(uintptr_t)(obj))
+#define val_from_bol(b) ((b) ? VAL_TRUE : VAL_FALSE)
+#define val_fits_i64(i) ((i) >= VAL_I64_MIN && (i) <= VAL_I64_MAX)
+#define val_fits_u64(u) ((u) <= VAL_U64_MAX)
+#define val_from_small_i64(i) (VAL_TAG_I64 | ((uint64_t)(i) & VAL_U64_MAX))
+#define val_from_small_u64(u) (VAL_TAG_U64 | (uint64_t)(u))
+
+static inline val val_from_f64(double f64) {
+  uint64_t bits;
+  memcpy(&bits, &f64, sizeof(bits));
+  if (f64 != f64) {
+    bits = VAL_F64_NAN;
+  }
+  return bits + VAL_F64_OFFSET;
+}
+
+static inline double val_as_f64(val v) {
+  uint64_t bits = v - VAL_F64_OFFSET;
+  double f64;
+  memcpy(&f64, &bits, sizeof(f64));
+  return f64;
+}
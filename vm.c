@@ -4,7 +4,9 @@
 #include "binops.h"
 #include "builtins.h"
 #include "hashmap.h"
+#include "kernels.h"
 #include <assert.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,148 +14,150 @@
 
 void vm_init(struct vm *vm) {
   assert(vm != NULL);
-  vm->heap_head = NULL;
-  vm->heap_tail = NULL;
+  heap_init(&vm->heap);
+  gc_init(&vm->gc);
   vm->source_exprs = NULL;
-  enclosing_init(&vm->globals, vm, NULL);
-  setup_builtins(&vm->globals);
-  timespec_get(&vm->last_gc, TIME_UTC);
+  vm->chunks = NULL;
+  vm->stack_size = 0LL;
+  vm->stack_cap = DEFAULT_VM_STACK_CAP;
+  vm->stack = malloc(sizeof(val) * vm->stack_cap);
+  vm->frames_size = 0LL;
+  vm->frames_cap = DEFAULT_VM_FRAMES_CAP;
+  vm->frames = malloc(sizeof(struct frame) * vm->frames_cap);
+  vm->iters_size = 0LL;
+  vm->iters_cap = DEFAULT_VM_ITERS_CAP;
+  vm->iters = malloc(sizeof(struct iter) * vm->iters_cap);
+  vm->globals_size = 0LL;
+  vm->globals_cap = DEFAULT_VM_GLOBALS_CAP;
+  vm->globals = malloc(sizeof(val) * vm->globals_cap);
+  vm->global_ids = malloc(sizeof(struct object *) * vm->globals_cap);
+  vm->symbols_size = 0LL;
+  vm->symbols_cap = DEFAULT_VM_SYMBOLS_CAP;
+  vm->symbols = calloc(vm->symbols_cap, sizeof(struct symbol));
+
+  struct object *empty_list = vm_alloc(vm, true);
+  empty_list->type = TYPE_LIST;
+  empty_list->list = (struct list){.items = NULL, .size = 0LL};
+  empty_list->list_kind = LIST_VALUES;
+  vm->empty_list = val_from_obj(empty_list);
+  setup_builtins(vm);
 }
 
 void vm_free(struct vm *vm) {
   assert(vm != NULL);
-  struct object *rem = vm->heap_head;
-  struct object *tmp = NULL;
-
-  while (rem != NULL) {
-    tmp = rem->gc_next;
-    object_free(rem);
-    free(rem);
-    rem = tmp;
+  heap_for_each(&vm->heap, obj, {
+    if (obj->flag != GC_FREE) {
+      object_free(obj);
+    }
+  });
+  heap_free(&vm->heap);
+
+  struct nursery *nursery = &vm->gc.nursery;
+  for (size_t ci = 0LL; ci < nursery->used; ci++) {
+    if (nursery->cells[ci].flag != GC_FORWARDED) {
+      object_free(&nursery->cells[ci]);
+    }
   }
+  gc_free(&vm->gc);
 
   if (vm->source_exprs != NULL) {
     free_def_exprs(vm->source_exprs);
     free(vm->source_exprs);
   }
 
-  enclosing_free(&vm->globals);
-}
+  free(vm->globals);
+  free(vm->global_ids);
+  free(vm->symbols);
 
-size_t vm_mark_all(struct vm *vm) {
-  struct object *cur = vm->heap_head;
-  size_t marked = 0LL;
-  while (cur != NULL) {
-    if (cur->flag == GC_ROOT) {
-      marked += object_mark(cur);
-    }
-    cur = cur->gc_next;
+  struct chunk *chunk = vm->chunks;
+  while (chunk != NULL) {
+    struct chunk *next = chunk->next;
+    chunk_free(chunk);
+    free(chunk);
+    chunk = next;
   }
 
-  return marked;
+  free(vm->stack);
+  free(vm->frames);
+  free(vm->iters);
 }
 
-size_t vm_sweep(struct vm *vm) {
-  struct object *cur = vm->heap_head;
-  struct object *last = NULL;
-  size_t collected = 0LL;
-
+struct object *vm_alloc(struct vm *vm, bool is_root) {
   // warning: this is not thread safe
-  while (cur != NULL) {
-    if (cur->flag == GC_UNMARKED) {
-      struct object *next = cur->gc_next;
-      if (last != NULL) {
-        last->gc_next = next;
-      } else {
-        vm->heap_head = next;
-      }
-
-      if (next == NULL) {
-        vm->heap_tail = NULL;
-      }
-
-      collected += object_free(cur);
-      free(cur);
-      cur = next;
-      continue;
-    } else {
-      cur->flag = GC_UNMARKED;
-    }
-
-    last = cur;
-    cur = cur->gc_next;
+  if (is_root) {
+    struct object *obj = heap_alloc(&vm->heap);
+    obj->flag = GC_ROOT;
+    gc_add_root(&vm->gc, obj);
+    vm->gc.allocated += sizeof(struct object);
+    return obj;
   }
 
-  return collected;
-}
-
-size_t vm_gc(struct vm *vm) {
-  struct timespec cur_time;
-  timespec_get(&cur_time, TIME_UTC);
-  if (cur_time.tv_nsec - vm->last_gc.tv_nsec < DEFAULT_GC_INTERVAL_NS) {
-    return 0LL;
+  struct object *obj = gc_alloc_young(&vm->gc);
+  if (obj == NULL) {
+    vm_gc(vm);
+    obj = gc_alloc_young(&vm->gc);
   }
 
-  size_t marked = vm_mark_all(vm);
-  size_t collected = vm_sweep(vm);
-  return marked - collected;
+  obj->flag = GC_UNMARKED;
+  return obj;
 }
 
-struct object *vm_alloc(struct vm *vm, bool is_root) {
-  struct object *obj = malloc(sizeof(struct object));
-  memset(obj, 0L, sizeof(struct object));
-  obj->flag = is_root ? GC_ROOT : GC_MARKED;
-
-  // warning: this is not thread safe
-  if (vm->heap_head == NULL) {
-    vm->heap_head = obj;
-  }
+val vm_box_i64(struct vm *vm, int64_t i64) {
+  struct object *obj = vm_alloc(vm, false);
+  obj->type = TYPE_I64;
+  obj->i64 = i64;
+  return val_from_obj(obj);
+}
 
-  if (vm->heap_tail != NULL) {
-    vm->heap_tail->gc_next = obj;
-  }
+val vm_box_u64(struct vm *vm, uint64_t u64) {
+  struct object *obj = vm_alloc(vm, false);
+  obj->type = TYPE_U64;
+  obj->u64 = u64;
+  return val_from_obj(obj);
+}
 
-  vm->heap_tail = obj;
-  // vm_gc(vm);
-  return obj;
+val vm_error(struct vm *vm, const char *format, ...) {
+  struct object *obj = vm_alloc(vm, false);
+  obj->type = TYPE_ERROR;
+  obj->error = malloc(sizeof(char) * DEFAULT_VM_ERROR_SIZE);
+  memset(obj->error, 0L, sizeof(char) * DEFAULT_VM_ERROR_SIZE);
+  vm->gc.allocated += DEFAULT_VM_ERROR_SIZE;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(obj->error, DEFAULT_VM_ERROR_SIZE, format, args);
+  va_end(args);
+  return val_from_obj(obj);
 }
 
-size_t object_free(struct object *obj) {
+// Bytes of the cell and of the payloads only it owns, a closure counts its
+// own slots but not the parents it shares.
+size_t object_size(struct object *obj) {
   assert(obj != NULL);
+  size_t size = sizeof(struct object);
   switch (obj->type) {
   case TYPE_STRING:
+    if (obj->small_size == OBJECT_LARGE_STRING) {
+      size += string_bytes(obj->string->size);
+    }
+    break;
   case TYPE_ERROR:
-    free(obj->string);
+    size += DEFAULT_VM_ERROR_SIZE;
     break;
-  case TYPE_PAIR: {
-    size_t hf = object_free(obj->pair.head);
-    size_t tf = object_free(obj->pair.tail);
-    free(obj->pair.head);
-    free(obj->pair.tail);
-    return hf + tf;
-  }
-  case TYPE_DICT: {
-    // hashmap_free(&obj->hashmap);
+  case TYPE_DICT:
+    size += sizeof(struct hashmap) + hashmap_bytes(obj->hashmap);
     break;
-  }
-  case TYPE_LIST: {
-    struct list *cur = obj->list;
-    struct list *tmp = NULL;
-    size_t total = 0LL;
-    while (cur != NULL) {
-      tmp = cur->next;
-      free(cur);
-      cur = tmp;
-    }
-    return total;
-  }
-  case TYPE_FUNCTION: {
-    if (obj->function.closure != NULL) {
-      enclosing_free(obj->function.closure);
-      free(obj->function.closure);
+  case TYPE_LIST:
+    // unboxed items are as wide as values
+    size += sizeof(val) * obj->list.size;
+    break;
+  case TYPE_FUNCTION:
+    size += sizeof(struct function);
+    if (obj->function->closure != NULL) {
+      size += env_bytes(obj->function->closure->size);
     }
     break;
-  }
+  case TYPE_PAIR:
   case TYPE_UNIT:
   case TYPE_NIL:
   case TYPE_BOL:
@@ -163,47 +167,48 @@ size_t object_free(struct object *obj) {
     break;
   }
 
-  return 1;
+  return size;
 }
 
-size_t object_mark(struct object *obj) {
+// Returns the bytes released, as counted by object_size.
+size_t object_free(struct object *obj) {
   assert(obj != NULL);
-  if (obj->flag == GC_MARKED) {
-    return 0;
-  }
-
-  if (obj->flag == GC_UNMARKED) {
-    obj->flag = GC_MARKED;
-  }
-
-  if (obj->type == TYPE_PAIR) {
-    size_t hm = object_mark(obj->pair.head);
-    size_t tm = object_mark(obj->pair.tail);
-    return hm + tm;
-  }
-
-  if (obj->type == TYPE_LIST) {
-    size_t tm = 0LL;
-    struct list *cur = obj->list;
-    while (cur != NULL) {
-      tm += object_mark(cur->item);
-      cur = cur->next;
+  size_t size = object_size(obj);
+  switch (obj->type) {
+  case TYPE_STRING:
+    if (obj->small_size == OBJECT_LARGE_STRING) {
+      free(obj->string);
     }
+    break;
+  case TYPE_ERROR:
+    free(obj->error);
+    break;
+  case TYPE_PAIR:
+    // head and tail are cells of their own, released by their own sweep
+    break;
+  case TYPE_DICT: {
+    hashmap_free(obj->hashmap);
+    free(obj->hashmap);
+    break;
   }
-
-  if (obj->type == TYPE_DICT) {
-    struct hashmap hm = obj->hashmap;
-    struct kv_entry **rows = hm.rows;
-    for (size_t ri = 0LL; ri < hm.total_rows; ri++) {
-      struct kv_entry *col = rows[ri];
-      while (col != NULL) {
-        object_mark(col->value);
-        col = col->next;
-      }
-    }
+  case TYPE_LIST:
+    free(obj->list.items);
+    break;
+  case TYPE_FUNCTION: {
+    env_release(obj->function->closure);
+    free(obj->function);
+    break;
+  }
+  case TYPE_UNIT:
+  case TYPE_NIL:
+  case TYPE_BOL:
+  case TYPE_U64:
+  case TYPE_I64:
+  case TYPE_F64:
+    break;
   }
 
-  return 1;
+  return size;
 }
 
 size_t dict_print_kvs(struct object *obj, bool debug) {
@@ -211,25 +216,19 @@ size_t dict_print_kvs(struct object *obj, bool debug) {
   assert(obj->type == TYPE_DICT);
 
   size_t wbytes = 0LL;
-  struct hashmap hm = obj->hashmap;
-  struct kv_entry **rows = hm.rows;
-  for (size_t ri = 0LL; ri < hm.total_rows; ri++) {
-    struct kv_entry *col = rows[ri];
-    while (col != NULL) {
-      wbytes += printf("%s: ", col->key);
-      wbytes += object_print(col->value, debug);
-      printf(", ");
-
-      col = col->next;
-    }
-  }
+  hashmap_for_each(obj->hashmap, slot, {
+    wbytes += printf("%s: ", str_chars(slot->key));
+    wbytes += val_print(slot->value, debug);
+    printf(", ");
+  });
 
   return wbytes;
 }
 
-size_t object_print(struct object *value, bool debug) {
+size_t val_print(val value, bool debug) {
   size_t wbytes = 0LL;
-  switch (value->type) {
+  struct object *obj = val_is_obj(value) ? val_as_obj(value) : NULL;
+  switch (val_type(value)) {
   case TYPE_NIL:
     wbytes += printf("nil");
     break;
@@ -241,68 +240,68 @@ size_t object_print(struct object *value, bool debug) {
     break;
   case TYPE_BOL:
     if (debug) {
-      wbytes += printf("bol(%d)", value->bol);
+      wbytes += printf("bol(%d)", value == VAL_TRUE);
     } else {
-      wbytes += printf(value->bol ? "true" : "false");
+      wbytes += printf(value == VAL_TRUE ? "true" : "false");
     }
     break;
   case TYPE_U64:
-    if (debug) {
-      wbytes += printf("u64(%lu)", value->u64);
-    } else {
-      wbytes += printf("%lu", value->u64);
-    }
+    wbytes += u64_print(val_u64(value), debug);
     break;
   case TYPE_I64:
-    if (debug) {
-      wbytes += printf("i64(%ld)", value->i64);
-    } else {
-      wbytes += printf("%ld", value->i64);
-    }
+    wbytes += i64_print(val_i64(value), debug);
     break;
   case TYPE_F64:
-    if (debug) {
-      wbytes += printf("f64(%lf)", value->f64);
-    } else {
-      wbytes += printf("%lf", value->f64);
-    }
+    wbytes += f64_print(val_as_f64(value), debug);
     break;
   case TYPE_STRING:
     if (debug) {
-      wbytes += printf("string('%s')", value->string);
+      wbytes += printf("string('%s')", str_chars(obj));
     } else {
-      wbytes += printf("%s", value->string);
+      wbytes += printf("%s", str_chars(obj));
     }
     break;
   case TYPE_PAIR:
     printf("pair(");
-    wbytes += object_print(value->pair.head, debug);
+    wbytes += val_print(obj->pair.head, debug);
     printf(",");
-    wbytes += object_print(value->pair.tail, debug);
+    wbytes += val_print(obj->pair.tail, debug);
     printf(")");
     break;
   case TYPE_LIST:
     wbytes += printf("list[");
-    struct list *item = value->list;
-    while (item != NULL) {
-      wbytes += object_print(item->item, debug);
-      item = item->next;
-      if (item != NULL) {
+    for (size_t li = 0LL; li < obj->list.size; li++) {
+      if (li > 0) {
         wbytes += printf(",");
       }
+
+      switch (obj->list_kind) {
+      case LIST_VALUES:
+        wbytes += val_print(obj->list.items[li], debug);
+        break;
+      case LIST_I64:
+        wbytes += i64_print(obj->list.i64s[li], debug);
+        break;
+      case LIST_U64:
+        wbytes += u64_print(obj->list.u64s[li], debug);
+        break;
+      case LIST_F64:
+        wbytes += f64_print(obj->list.f64s[li], debug);
+        break;
+      }
     }
     wbytes += printf("]");
     break;
   case TYPE_DICT:
     wbytes += printf("dict{");
-    wbytes += dict_print_kvs(value, debug);
+    wbytes += dict_print_kvs(obj, debug);
     wbytes += printf("}");
     break;
   case TYPE_ERROR:
     if (debug) {
-      wbytes += printf("error('%s')", value->string);
+      wbytes += printf("error('%s')", obj->error);
     } else {
-      wbytes += printf("%s", value->string);
+      wbytes += printf("%s", obj->error);
     }
     break;
   }
@@ -310,823 +309,945 @@ size_t object_print(struct object *value, bool debug) {
   return wbytes;
 }
 
-void enclosing_init(struct enclosing *e, struct vm *vm,
-                    struct enclosing *parent) {
-  assert(e != NULL);
-  e->vm = vm;
-  e->parent = parent;
-  e->head = NULL;
-  e->tail = NULL;
-}
-
-void enclosing_capture(struct enclosing *into, struct enclosing *from) {
-  assert(into != NULL);
-  if (from == NULL) {
+// Fills a string object with left followed by right, in the cell when they
+// fit, none may point into the chars of obj itself.
+void str_fill(struct vm *vm, struct object *obj, const char *left,
+              size_t left_size, const char *right, size_t right_size) {
+  assert(obj != NULL);
+  obj->type = TYPE_STRING;
+  obj->interned = false;
+  size_t size = left_size + right_size;
+  if (size >= OBJECT_SMALL_CHARS) {
+    obj->small_size = OBJECT_LARGE_STRING;
+    obj->string = string_concat(left, left_size, right, right_size);
+    vm->gc.allocated += string_bytes(size);
     return;
   }
 
-  struct bind *src_bind = from->head;
-  while (src_bind != NULL) {
-    struct bind *cpy_bind = malloc(sizeof(struct bind));
-    cpy_bind->id = strdup(src_bind->id);
-    cpy_bind->object = src_bind->object;
-    cpy_bind->next = NULL;
+  obj->small_size = size;
+  memcpy(obj->small, left, left_size);
+  if (right_size > 0) {
+    memcpy(obj->small + left_size, right, right_size);
+  }
+  obj->small[size] = '\0';
+}
+
+void str_rope(struct vm *vm, struct object *obj, val left, val right) {
+  assert(obj != NULL);
+  assert(val_type(left) == TYPE_STRING && val_type(right) == TYPE_STRING);
+  obj->type = TYPE_STRING;
+  obj->interned = false;
+  obj->small_size = OBJECT_ROPE_STRING;
+  obj->rope = (struct rope){
+      .left = left,
+      .right = right,
+      .size = str_size(val_as_obj(left)) + str_size(val_as_obj(right)),
+  };
+
+  // the chars are counted now since flattening has no vm to count them on
+  vm->gc.allocated += string_bytes(obj->rope.size);
+  gc_write_barrier(vm, obj, left);
+  gc_write_barrier(vm, obj, right);
+}
 
-    if (into->head == NULL) {
-      into->head = cpy_bind;
+// Turns a rope into a large string in place, pieces are copied from the end
+// so chains built by appending keep two of them pending at most. Nothing is
+// allocated in the heap, the pieces stay where they are while copied.
+const char *str_flatten(struct object *obj) {
+  assert(obj != NULL);
+  assert(obj->small_size == OBJECT_ROPE_STRING);
+  struct string *flat = string_alloc(obj->rope.size);
+  size_t end = flat->size;
+
+  size_t pending_cap = DEFAULT_STR_FLATTEN_CAP;
+  struct object **pending = malloc(sizeof(struct object *) * pending_cap);
+  assert(pending != NULL);
+  pending[0] = val_as_obj(obj->rope.left);
+  pending[1] = val_as_obj(obj->rope.right);
+  size_t pending_size = 2;
+
+  while (pending_size > 0) {
+    struct object *piece = pending[--pending_size];
+    if (piece->small_size != OBJECT_ROPE_STRING) {
+      end -= str_size(piece);
+      memcpy(flat->chars + end, str_chars(piece), str_size(piece));
+      continue;
     }
 
-    if (into->tail != NULL) {
-      into->tail->next = cpy_bind;
+    if (pending_size + 2 > pending_cap) {
+      pending_cap *= 2;
+      pending = realloc(pending, sizeof(struct object *) * pending_cap);
+      assert(pending != NULL);
     }
 
-    into->tail = cpy_bind;
-    src_bind = src_bind->next;
+    pending[pending_size++] = val_as_obj(piece->rope.left);
+    pending[pending_size++] = val_as_obj(piece->rope.right);
   }
-}
 
-void enclosing_free(struct enclosing *e) {
-  assert(e != NULL);
-  struct bind *cur = e->head;
-  struct bind *tmp = NULL;
+  assert(end == 0);
+  free(pending);
+  obj->small_size = OBJECT_LARGE_STRING;
+  obj->string = flat;
+  return flat->chars;
+}
 
-  // only release stuff outside gc tracking
-  while (cur != NULL) {
-    tmp = cur->next;
-    if (cur->id != NULL) {
-      free(cur->id);
-    }
+// Small strings are cheap enough to hash again on every lookup.
+uint64_t str_hash(struct object *obj) {
+  assert(obj != NULL);
+  assert(obj->type == TYPE_STRING);
+  if (obj->small_size == OBJECT_ROPE_STRING) {
+    str_flatten(obj);
+  }
 
-    free(cur);
-    cur = tmp;
+  if (obj->small_size == OBJECT_LARGE_STRING) {
+    return string_hash(obj->string);
   }
 
-  e->head = NULL;
-  e->tail = NULL;
+  return string_hash_chars(obj->small, obj->small_size);
 }
 
-void enclosing_bind(struct enclosing *e, struct object *object, char *id) {
-  assert(e != NULL);
-  assert(object != NULL);
-  assert(id != NULL);
+bool str_equals(struct object *left, struct object *right) {
+  assert(left != NULL);
+  assert(right != NULL);
+  if (left == right) {
+    return true;
+  }
 
-  struct bind *binding = malloc(sizeof(struct bind));
-  binding->next = NULL;
-  binding->object = object;
-  binding->id = id;
+  // equal symbols are the same object
+  if ((left->interned && right->interned) ||
+      str_size(left) != str_size(right)) {
+    return false;
+  }
 
-  if (e->head == NULL) {
-    e->head = binding;
+  if (left->small_size == OBJECT_ROPE_STRING) {
+    str_flatten(left);
   }
 
-  if (e->tail != NULL) {
-    e->tail->next = binding;
+  if (right->small_size == OBJECT_ROPE_STRING) {
+    str_flatten(right);
   }
 
-  e->tail = binding;
-}
+  if (left->small_size == OBJECT_LARGE_STRING &&
+      right->small_size == OBJECT_LARGE_STRING) {
+    return string_equals(left->string, right->string);
+  }
 
-struct bind *enclosing_find(struct enclosing *e, char *id) {
-  assert(e != NULL);
-  assert(id != NULL);
-  struct bind *cur = e->head;
-  while (cur != NULL) {
-    if (strcmp(cur->id, id) == 0) {
-      return cur;
-    }
+  return memcmp(str_chars(left), str_chars(right), str_size(left)) == 0;
+}
 
-    cur = cur->next;
+struct object *symbol_intern(struct vm *vm, const char *chars, size_t size) {
+  assert(vm != NULL);
+  uint64_t hash = string_hash_chars(chars, size);
+  struct symbol *slot = symbol_probe(vm, chars, size, hash);
+  if (slot->string != NULL) {
+    return slot->string;
   }
 
-  if (e->parent != NULL) {
-    return enclosing_find(e->parent, id);
+  struct object *string = vm_alloc(vm, true);
+  str_fill(vm, string, chars, size, NULL, 0LL);
+  string->interned = true;
+  *slot = (struct symbol){.hash = hash, .string = string};
+  if (++vm->symbols_size * 2 > vm->symbols_cap) {
+    symbol_grow(vm);
   }
-
-  return NULL;
+  return string;
 }
 
-struct object *vm_run_main(struct vm *vm) {
+struct object *symbol_lookup(struct vm *vm, const char *chars, size_t size,
+                             uint64_t hash) {
   assert(vm != NULL);
+  return symbol_probe(vm, chars, size, hash)->string;
+}
 
-  struct enclosing main_enclosing;
-  enclosing_init(&main_enclosing, vm, &vm->globals);
+// Strings made at run time go through the table once, symbols are their own.
+struct object *symbol_find(struct vm *vm, struct object *string) {
+  assert(string != NULL);
+  assert(string->type == TYPE_STRING);
+  if (string->interned) {
+    return string;
+  }
 
-  struct call_expr main_call = {
-      .callee = "main",
-      .args = NULL,
-  };
-  struct object *res = vm_run_call(&main_enclosing, &main_call);
+  return symbol_lookup(vm, str_chars(string), str_size(string),
+                       str_hash(string));
+}
 
-  enclosing_free(&main_enclosing);
-  return res;
+// Returns the slot holding chars or the empty one where they would go, the
+// table is kept at most half full so there always is one.
+struct symbol *symbol_probe(struct vm *vm, const char *chars, size_t size,
+                            uint64_t hash) {
+  size_t mask = vm->symbols_cap - 1;
+  for (size_t si = hash & mask;; si = (si + 1) & mask) {
+    struct symbol *slot = &vm->symbols[si];
+    if (slot->string == NULL) {
+      return slot;
+    }
+
+    if (slot->hash == hash && str_size(slot->string) == size &&
+        memcmp(str_chars(slot->string), chars, size) == 0) {
+      return slot;
+    }
+  }
 }
 
-void vm_define_all(struct vm *vm, struct def_exprs *defs) {
-  assert(vm != NULL);
-  assert(defs != NULL);
-  vm->source_exprs = defs;
+void symbol_grow(struct vm *vm) {
+  struct symbol *old = vm->symbols;
+  size_t old_cap = vm->symbols_cap;
+  vm->symbols_cap *= 2;
+  vm->symbols = calloc(vm->symbols_cap, sizeof(struct symbol));
+  assert(vm->symbols != NULL);
+  size_t mask = vm->symbols_cap - 1;
+  for (size_t si = 0LL; si < old_cap; si++) {
+    if (old[si].string == NULL) {
+      continue;
+    }
 
-  struct def_exprs *cur = defs;
-  while (cur != NULL) {
-    struct object *to_define = vm_run_def(vm, cur->def_expr);
-    assert(to_define->type == TYPE_FUNCTION);
-    enclosing_bind(&vm->globals, to_define, strdup(to_define->function.id));
-    cur = cur->next;
+    size_t at = old[si].hash & mask;
+    while (vm->symbols[at].string != NULL) {
+      at = (at + 1) & mask;
+    }
+    vm->symbols[at] = old[si];
   }
+
+  free(old);
 }
 
-struct object *vm_run_def(struct vm *vm, struct def_expr *def) {
-  assert(vm != NULL);
-  assert(def != NULL);
-
-  struct object *object = vm_alloc(vm, true);
-  object->type = TYPE_FUNCTION;
-  object->function = (struct function){
-      .target = TARGET_SCRIPT,
-      .native_call = NULL,
-      .closure = NULL,
-      .params = def->params,
-      .body = def->body,
-      .id = def->id,
-  };
+size_t i64_print(int64_t i64, bool debug) {
+  char chars[NUM_CHARS_MAX];
+  return num_print("i64", chars, num_format_i64(chars, i64), debug);
+}
 
-  return object;
+size_t u64_print(uint64_t u64, bool debug) {
+  char chars[NUM_CHARS_MAX];
+  return num_print("u64", chars, num_format_u64(chars, u64), debug);
 }
 
-struct object *vm_run_lit(struct enclosing *encl, struct lit_expr *lit_expr) {
-  assert(encl != NULL);
-  assert(lit_expr != NULL);
-
-  struct object *res = vm_alloc(encl->vm, false);
-  if (lit_expr->type == LIT_STRING) {
-    res->type = TYPE_STRING;
-    size_t quoted_size = strlen(lit_expr->raw_value);
-    res->string = strndup(lit_expr->raw_value + 1, quoted_size - 2);
-  } else {
-    if (strstr(lit_expr->raw_value, ".") != NULL) {
-      res->type = TYPE_F64;
-      res->f64 = strtod(lit_expr->raw_value, NULL);
-    } else {
-      res->type = TYPE_I64;
-      res->i64 = strtol(lit_expr->raw_value, NULL, 10);
-    }
+size_t f64_print(double f64, bool debug) {
+  char chars[NUM_CHARS_MAX];
+  return num_print("f64", chars, num_format_f64(chars, f64), debug);
+}
+
+size_t num_print(const char *type, const char *chars, size_t size,
+                 bool debug) {
+  if (!debug) {
+    return fwrite(chars, 1, size, stdout);
   }
 
-  return res;
+  return printf("%s(", type) + fwrite(chars, 1, size, stdout) + printf(")");
 }
 
-struct object *vm_run_lookup(struct enclosing *encl,
-                             struct lookup_expr *lookup_expr) {
-  assert(encl != NULL);
-  assert(lookup_expr != NULL);
-
-  if (lookup_expr->type == LOOKUP_ID) {
-    struct bind *bind = enclosing_find(encl, lookup_expr->id);
-    if (bind == NULL) {
-      struct object *res = vm_alloc(encl->vm, false);
-      make_errorf(res, "undefined variable '%s'", lookup_expr->id);
-      return res;
+// Called once the items of a new list are in place, numbers sharing a type
+// are unboxed in the same array, anything else keeps its values and gets
+// them barriered.
+void list_pack(struct vm *vm, struct object *obj) {
+  assert(obj != NULL);
+  assert(obj->type == TYPE_LIST);
+  struct list *list = &obj->list;
+  enum object_type type = list->size > 0 ? val_type(list->items[0]) : TYPE_LIST;
+  for (size_t li = 1LL; li < list->size && type != TYPE_LIST; li++) {
+    if (val_type(list->items[li]) != type) {
+      type = TYPE_LIST;
     }
+  }
 
-    return bind->object;
-  } else {
-    assert(lookup_expr->object != NULL);
-    assert(lookup_expr->key != NULL);
-
-    struct object *res = NULL;
-    struct object *key = vm_run_expr(encl, lookup_expr->key);
-    struct object *base = vm_run_expr(encl, lookup_expr->object);
-    switch (base->type) {
-    case TYPE_PAIR:
-      if (key->type != TYPE_I64 && key->type != TYPE_U64) {
-        res = vm_alloc(encl->vm, false);
-        make_errorf(res, "invalid index type: %d", key->type);
-        return res;
-      }
-
-      if (key->u64 > 1) {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "index out of range");
-        return res;
-      }
+  switch (type) {
+  case TYPE_I64:
+    obj->list_kind = LIST_I64;
+    for (size_t li = 0LL; li < list->size; li++) {
+      list->i64s[li] = val_i64(list->items[li]);
+    }
+    break;
+  case TYPE_U64:
+    obj->list_kind = LIST_U64;
+    for (size_t li = 0LL; li < list->size; li++) {
+      list->u64s[li] = val_u64(list->items[li]);
+    }
+    break;
+  case TYPE_F64:
+    obj->list_kind = LIST_F64;
+    for (size_t li = 0LL; li < list->size; li++) {
+      list->f64s[li] = val_as_f64(list->items[li]);
+    }
+    break;
+  default:
+    obj->list_kind = LIST_VALUES;
+    for (size_t li = 0LL; li < list->size; li++) {
+      gc_write_barrier(vm, obj, list->items[li]);
+    }
+    break;
+  }
+}
 
-      if (key->u64 == 0) {
-        return base->pair.head;
-      } else {
-        return base->pair.tail;
-      }
-      break;
-    case TYPE_LIST:
-      if (key->type != TYPE_I64 && key->type != TYPE_U64) {
-        res = vm_alloc(encl->vm, false);
-        make_errorf(res, "invalid index type: %d", key->type);
-        return res;
-      }
+// Integers too wide for an immediate are boxed again, the item is read
+// before that allocation may move the list.
+val list_get(struct vm *vm, struct object *obj, size_t index) {
+  assert(obj != NULL);
+  assert(index < obj->list.size);
+  switch (obj->list_kind) {
+  case LIST_I64:
+    return vm_i64(vm, obj->list.i64s[index]);
+  case LIST_U64:
+    return vm_u64(vm, obj->list.u64s[index]);
+  case LIST_F64:
+    return val_from_f64(obj->list.f64s[index]);
+  case LIST_VALUES:
+    break;
+  }
 
-      if (key->type == TYPE_I64 && key->u64 < 0) {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "index out of range");
-        return res;
-      }
+  return obj->list.items[index];
+}
 
-      size_t index = 0LL;
-      struct list *cur = base->list;
-      while (cur != NULL) {
-        if (index == key->u64) {
-          res = cur->item;
-          break;
-        }
+struct env *env_capture(struct env *parent, val *slots, size_t size) {
+  struct env *env = malloc(env_bytes(size));
+  env->parent = parent;
+  env->refs = 1;
+  env->size = size;
+  memcpy(env->slots, slots, sizeof(val) * size);
 
-        index++;
-        cur = cur->next;
-      }
+  if (parent != NULL) {
+    parent->refs++;
+  }
 
-      if (res == NULL) {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "index out of range");
-        return res;
-      } else {
-        return res;
-      }
-      break;
-    case TYPE_DICT:
-      if (key->type != TYPE_STRING) {
-        res = vm_alloc(encl->vm, false);
-        make_errorf(res, "invalid index type: %d", key->type);
-        return res;
-      }
+  return env;
+}
 
-      enum hashmap_state state = hashmap_get(&base->hashmap, key->string, &res);
-      if (state == HM_KEY_NOT_FOUND) {
-        make_error(res, "key not found");
-        return res;
-      }
+// Sweeping threads may drop references to the same parent at once.
+void env_release(struct env *env) {
+  while (env != NULL &&
+         __atomic_sub_fetch(&env->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct env *parent = env->parent;
+    free(env);
+    env = parent;
+  }
+}
 
-      if (state != HM_OK) {
-        make_error(res, "invalid or corrupt hashmap");
-        return res;
-      }
+// value may be VAL_NULL to reserve the global of something not yet compiled
+size_t vm_define_global(struct vm *vm, char *id, val value) {
+  assert(vm != NULL);
+  assert(id != NULL);
+  if (vm->globals_size == vm->globals_cap) {
+    vm->globals_cap *= 2;
+    vm->globals = realloc(vm->globals, sizeof(val) * vm->globals_cap);
+    vm->global_ids =
+        realloc(vm->global_ids, sizeof(struct object *) * vm->globals_cap);
+  }
 
-      return res;
-    case TYPE_STRING:
-      if (key->type != TYPE_I64 && key->type != TYPE_U64) {
-        res = vm_alloc(encl->vm, false);
-        make_errorf(res, "invalid index type: %d", key->type);
-        return res;
-      }
+  vm->globals[vm->globals_size] = value;
+  vm->global_ids[vm->globals_size] = symbol_intern(vm, id, strlen(id));
+  return vm->globals_size++;
+}
 
-      if (key->type == TYPE_I64 && key->u64 < 0) {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "index out of range");
-        return res;
-      }
+bool vm_find_global(struct vm *vm, char *id, size_t *index_out) {
+  assert(vm != NULL);
+  assert(id != NULL);
+  size_t size = strlen(id);
+  struct object *symbol =
+      symbol_lookup(vm, id, size, string_hash_chars(id, size));
+  for (size_t gi = 0LL; symbol != NULL && gi < vm->globals_size; gi++) {
+    if (vm->global_ids[gi] == symbol) {
+      *index_out = gi;
+      return true;
+    }
+  }
 
-      if (key->u64 > strlen(base->string)) {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "index out of range");
-        return res;
-      }
+  return false;
+}
 
-      res = vm_alloc(encl->vm, false);
-      res->type = TYPE_U64;
-      res->u64 = base->string[key->u64];
-      return res;
-    case TYPE_UNIT:
-    case TYPE_NIL:
-    case TYPE_BOL:
-    case TYPE_U64:
-    case TYPE_I64:
-    case TYPE_F64:
-    case TYPE_ERROR:
-    case TYPE_FUNCTION:
-      res = vm_alloc(encl->vm, false);
-      make_errorf(res, "cannot index object of type: %d", base->type);
-      return res;
-    }
+void vm_push(struct vm *vm, val value) {
+  assert(vm != NULL);
+  assert(value != VAL_NULL);
+  if (vm->stack_size == vm->stack_cap) {
+    vm->stack_cap *= 2;
+    vm->stack = realloc(vm->stack, sizeof(val) * vm->stack_cap);
   }
 
-  return NULL;
+  vm->stack[vm->stack_size++] = value;
 }
 
-struct object *vm_run_bin(struct enclosing *encl, struct bin_expr *bin_expr) {
-  assert(encl != NULL);
-  assert(bin_expr != NULL);
-  struct object *left = vm_run_expr(encl, bin_expr->left);
-  struct object *right = vm_run_expr(encl, bin_expr->right);
-  return handle_bin_op(encl->vm, left, right, bin_expr->op);
+val vm_pop(struct vm *vm) {
+  assert(vm != NULL);
+  assert(vm->stack_size > 0);
+  return vm->stack[--vm->stack_size];
 }
 
-struct object *vm_run_unit(struct enclosing *encl,
-                           struct unit_expr *unit_expr) {
-  assert(encl != NULL);
-  assert(unit_expr != NULL);
-  struct object *res = vm_alloc(encl->vm, false);
-  struct object *right = vm_run_expr(encl, unit_expr->right);
-  if (unit_expr->op == OP_NEG) {
-    switch (right->type) {
-    case TYPE_U64:
-    case TYPE_I64:
-      res->type = TYPE_I64;
-      res->i64 = -right->i64;
-      break;
-    case TYPE_F64:
-      res->type = TYPE_F64;
-      res->f64 = -right->f64;
-      break;
-    default:
-      make_error(res, "unsupported operation for type");
-      break;
-    }
-  } else if (unit_expr->op == OP_NOT) {
-    switch (right->type) {
-    case TYPE_U64:
-    case TYPE_I64:
-      res->type = TYPE_I64;
-      res->i64 = !right->i64;
-      break;
-    case TYPE_F64:
-      res->type = TYPE_F64;
-      res->f64 = !right->f64;
-      break;
-    default:
-      make_error(res, "unsupported operation for type");
-      break;
-    }
-  } else {
-    make_error(res, "unrecognized unitary operation");
+// Falsy values are the ones whose payload is all zeros, nil, unit and false
+// included, just like objects used to be read through their u64 field.
+bool val_truthy(val value) {
+  assert(value != VAL_NULL);
+  if (val_is_f64(value)) {
+    return value != VAL_F64_OFFSET;
   }
 
-  return res;
+  if (val_is_small_i64(value) || val_is_small_u64(value)) {
+    return (value & VAL_U64_MAX) != 0;
+  }
+
+  if (!val_is_obj(value)) {
+    return value == VAL_TRUE;
+  }
+
+  return val_as_obj(value)->u64 != 0;
 }
 
-struct object *vm_run_let(struct enclosing *encl, struct let_expr *let_expr) {
-  assert(encl != NULL);
-  assert(let_expr != NULL);
-  struct enclosing forked;
-  enclosing_init(&forked, encl->vm, encl);
-
-  struct let_assigns *assign = let_expr->assigns;
-  while (assign != NULL) {
-    struct object *object = vm_run_expr(encl, assign->expr);
-    enclosing_bind(&forked, object, strdup(assign->id));
-    assign = assign->next;
+val vm_run_main(struct vm *vm) {
+  assert(vm != NULL);
+
+  size_t main_index = 0LL;
+  if (!vm_find_global(vm, "main", &main_index) ||
+      val_type(vm->globals[main_index]) != TYPE_FUNCTION) {
+    return vm_error(vm, "undefined function '%s'", "main");
   }
 
-  struct object *res = vm_run_expr(&forked, let_expr->in_expr);
-  enclosing_free(&forked);
-  return res;
+  return vm_call(vm, vm->globals[main_index], NULL, 0);
 }
 
-struct object *vm_run_function(struct enclosing *encl, struct function function,
-                               struct call_args *expr_args,
-                               struct list *value_args) {
-  struct object *res = NULL;
-  if (function.target == TARGET_SCRIPT) {
-    struct enclosing forked;
-    if (function.closure != NULL) {
-      enclosing_init(&forked, encl->vm, function.closure);
-    } else {
-      enclosing_init(&forked, encl->vm, &encl->vm->globals);
-    }
-    struct def_params *recv_param = function.params;
-    struct call_args *send_param = expr_args;
-    struct list *send_param_value = value_args;
-    while (send_param != NULL || send_param_value != NULL) {
-      if (recv_param == NULL) {
-        enclosing_free(&forked);
-
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "function expects more arguments");
-        return res;
-      }
+void vm_define_all(struct vm *vm, struct def_exprs *defs) {
+  assert(vm != NULL);
+  assert(defs != NULL);
+  vm->source_exprs = defs;
 
-      struct object *arg_value;
-      if (send_param != NULL) {
-        arg_value = vm_run_expr(encl, send_param->expr);
-        send_param = send_param->next;
-      } else if (send_param_value != NULL) {
-        arg_value = send_param_value->item;
-        send_param_value = send_param_value->next;
-      } else {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "expecting a value or expression argument");
-        return res;
-      }
+  // every name gets its global first so bodies can refer to any def
+  size_t first = vm->globals_size;
+  struct def_exprs *cur = defs;
+  while (cur != NULL) {
+    vm_define_global(vm, cur->def_expr->id, VAL_NULL);
+    cur = cur->next;
+  }
 
-      enclosing_bind(&forked, arg_value, strdup(recv_param->id));
-      recv_param = recv_param->next;
-    }
+  size_t gi = first;
+  cur = defs;
+  while (cur != NULL) {
+    struct def_expr *def = cur->def_expr;
+    struct object *to_define =
+        compile_function(vm, NULL, def->id, def->params, def->body);
+    assert(to_define->type == TYPE_FUNCTION);
+    vm->globals[gi++] = val_from_obj(to_define);
+    cur = cur->next;
+  }
+}
 
-    res = vm_run_expr(&forked, function.body);
-    enclosing_free(&forked);
-    return res;
-  } else {
-    native_fun callee = function.native_call;
-    struct call_args *send_param = expr_args;
-    struct list *send_param_value = value_args;
-    struct list *params_head = NULL;
-    struct list *params_tail = NULL;
-
-    while (send_param != NULL || send_param_value != NULL) {
-      struct list *item = malloc(sizeof(struct list));
-      item->next = NULL;
-      if (send_param != NULL) {
-        item->item = vm_run_expr(encl, send_param->expr);
-        send_param = send_param->next;
-      } else if (send_param_value != NULL) {
-        item->item = send_param_value->item;
-        send_param_value = send_param_value->next;
-      } else {
-        res = vm_alloc(encl->vm, false);
-        make_error(res, "expecting a value or expression argument");
-        return res;
-      }
+// Takes the callee and its argc arguments from the top of the stack, when the
+// callee is a script a new frame is pushed and true is returned, otherwise the
+// result of the call is already on top of the stack.
+bool vm_enter(struct vm *vm, size_t argc) {
+  assert(vm->stack_size > argc);
+  size_t base = vm->stack_size - argc;
+  val callee = vm->stack[base - 1];
+  val res = VAL_NULL;
+
+  if (val_type(callee) == TYPE_ERROR) {
+    vm->stack_size = base - 1;
+    vm_push(vm, callee);
+    return false;
+  }
 
-      if (params_head == NULL) {
-        params_head = item;
-      }
+  if (val_type(callee) != TYPE_FUNCTION) {
+    res = vm_error(vm, "cannot call object of type: %d",
+                   val_type(vm->stack[base - 1]));
+    vm->stack_size = base - 1;
+    vm_push(vm, res);
+    return false;
+  }
 
-      if (params_tail != NULL) {
-        params_tail->next = item;
-      }
+  struct function *function = val_as_obj(callee)->function;
+  if (function->target == TARGET_NATIVE) {
+    res = function->native_call(vm, vm->stack + base, argc);
+    vm->stack_size = base - 1;
+    vm_push(vm, res);
+    return false;
+  }
 
-      params_tail = item;
-    }
+  struct chunk *chunk = function->chunk;
+  if (argc > chunk->nparams) {
+    vm->stack_size = base - 1;
+    res = vm_error(vm, "function expects more arguments");
+    vm_push(vm, res);
+    return false;
+  }
 
-    struct enclosing forked;
-    if (function.closure != NULL) {
-      enclosing_init(&forked, encl->vm, function.closure);
-    } else {
-      enclosing_init(&forked, encl->vm, &encl->vm->globals);
+  // missing arguments are left unbound, just as if they were never defined
+  struct def_params *param = function->params;
+  for (size_t pi = 0LL; pi < chunk->nparams; pi++) {
+    if (pi >= argc) {
+      res = vm_error(vm, "undefined variable '%s'", param->id);
+      vm_push(vm, res);
     }
+    param = param->next;
+  }
+
+  // the callee may have been moved by the allocations above
+  callee = vm->stack[base - 1];
+
+  while (vm->stack_size + (chunk->nslots - chunk->nparams) > vm->stack_cap) {
+    vm->stack_cap *= 2;
+    vm->stack = realloc(vm->stack, sizeof(val) * vm->stack_cap);
+  }
 
-    struct object *args = vm_alloc(encl->vm, false);
-    args->type = TYPE_LIST;
-    args->list = params_head;
+  for (size_t si = chunk->nparams; si < chunk->nslots; si++) {
+    vm->stack[vm->stack_size++] = VAL_NULL;
+  }
 
-    enclosing_bind(&forked, args, strdup("args"));
-    res = callee(&forked);
-    enclosing_free(&forked);
-    return res;
+  if (vm->frames_size == vm->frames_cap) {
+    vm->frames_cap *= 2;
+    vm->frames = realloc(vm->frames, sizeof(struct frame) * vm->frames_cap);
   }
+
+  vm->frames[vm->frames_size++] = (struct frame){
+      .callee = val_as_obj(callee),
+      .ip = chunk->code,
+      .base = base,
+  };
+  return true;
 }
 
-struct object *vm_run_call(struct enclosing *encl,
-                           struct call_expr *call_expr) {
-  assert(encl != NULL);
-  assert(call_expr != NULL);
+val vm_call(struct vm *vm, val callee, val *argv, size_t argc) {
+  assert(vm != NULL);
+  assert(callee != VAL_NULL);
+  vm_push(vm, callee);
+  for (size_t ai = 0LL; ai < argc; ai++) {
+    vm_push(vm, argv[ai]);
+  }
 
-  struct bind *fun_bind = enclosing_find(encl, call_expr->callee);
-  if (fun_bind == NULL) {
-    struct object *res = vm_alloc(encl->vm, false);
-    make_errorf(res, "undefined function '%s'", call_expr->callee);
-    return res;
+  if (vm_enter(vm, argc)) {
+    return vm_exec(vm);
   }
 
-  struct object *fun_object = fun_bind->object;
-  struct function function = fun_object->function;
-  return vm_run_function(encl, function, call_expr->args, NULL);
+  return vm_pop(vm);
 }
 
-struct object *vm_run_if(struct enclosing *encl, struct if_expr *if_expr) {
-  assert(encl != NULL);
-  assert(if_expr != NULL);
-
-  struct object *res;
-  struct cond_expr *cur_cond = if_expr->conds;
-  while (cur_cond != NULL) {
-    struct object *cond_res = vm_run_expr(encl, cur_cond->cond);
-    if (cond_res->type == TYPE_UNIT) {
-      res = vm_alloc(encl->vm, false);
-      make_error(res, "cannot evaluate condition for unit type");
-      return res;
+// Only errors are allocated here, once nothing else is read from base.
+val vm_index(struct vm *vm, val base, val key) {
+  assert(vm != NULL);
+  assert(base != VAL_NULL);
+  assert(key != VAL_NULL);
+
+  enum object_type key_type = val_type(key);
+  val res = VAL_NULL;
+  switch (val_type(base)) {
+  case TYPE_PAIR:
+    if (key_type != TYPE_I64 && key_type != TYPE_U64) {
+      res = vm_error(vm, "invalid index type: %d", key_type);
+      break;
     }
 
-    if (cond_res->u64) {
-      res = vm_run_expr(encl, cur_cond->then);
-      return res;
+    if (val_u64(key) > 1) {
+      res = vm_error(vm, "index out of range");
+      break;
     }
 
-    cur_cond = cur_cond->next;
-  }
+    if (val_u64(key) == 0) {
+      res = val_as_obj(base)->pair.head;
+    } else {
+      res = val_as_obj(base)->pair.tail;
+    }
+    break;
+  case TYPE_LIST:
+    if (key_type != TYPE_I64 && key_type != TYPE_U64) {
+      res = vm_error(vm, "invalid index type: %d", key_type);
+      break;
+    }
 
-  res = vm_run_expr(encl, if_expr->else_expr);
-  return res;
-}
+    if (key_type == TYPE_I64 && val_i64(key) < 0) {
+      res = vm_error(vm, "index out of range");
+      break;
+    }
 
-struct object *vm_run_list(struct enclosing *encl,
-                           struct list_expr *list_expr) {
-  assert(encl != NULL);
+    if (val_u64(key) >= val_as_obj(base)->list.size) {
+      res = vm_error(vm, "index out of range");
+      break;
+    }
 
-  struct list_expr *cur = list_expr;
-  struct list *head = NULL;
-  struct list *tail = NULL;
-  while (cur != NULL) {
-    struct list *item = malloc(sizeof(struct list));
-    item->next = NULL;
-    item->item = vm_run_expr(encl, cur->item);
+    res = list_get(vm, val_as_obj(base), val_u64(key));
+    break;
+  case TYPE_DICT:
+    if (key_type != TYPE_STRING) {
+      res = vm_error(vm, "invalid index type: %d", key_type);
+      break;
+    }
+
+    // keys never made into a symbol cannot be in any dict
+    struct object *symbol = symbol_find(vm, val_as_obj(key));
+    enum hashmap_state state =
+        symbol == NULL
+            ? HM_KEY_NOT_FOUND
+            : hashmap_get(val_as_obj(base)->hashmap, symbol, &res);
+    if (state == HM_KEY_NOT_FOUND) {
+      res = vm_error(vm, "key not found");
+      break;
+    }
+
+    if (state != HM_OK) {
+      res = vm_error(vm, "invalid or corrupt hashmap");
+    }
+    break;
+  case TYPE_STRING:
+    if (key_type != TYPE_I64 && key_type != TYPE_U64) {
+      res = vm_error(vm, "invalid index type: %d", key_type);
+      break;
+    }
 
-    if (head == NULL) {
-      head = item;
+    if (key_type == TYPE_I64 && val_i64(key) < 0) {
+      res = vm_error(vm, "index out of range");
+      break;
     }
 
-    if (tail != NULL) {
-      tail->next = item;
+    struct object *string = val_as_obj(base);
+    if (val_u64(key) > str_size(string)) {
+      res = vm_error(vm, "index out of range");
+      break;
     }
 
-    tail = item;
-    cur = cur->next;
+    res = vm_u64(vm, str_chars(string)[val_u64(key)]);
+    break;
+  case TYPE_UNIT:
+  case TYPE_NIL:
+  case TYPE_BOL:
+  case TYPE_U64:
+  case TYPE_I64:
+  case TYPE_F64:
+  case TYPE_ERROR:
+  case TYPE_FUNCTION:
+    res = vm_error(vm, "cannot index object of type: %d", val_type(base));
+    break;
   }
 
-  struct object *res = vm_alloc(encl->vm, false);
-  res->type = TYPE_LIST;
-  res->list = head;
   return res;
 }
 
-struct object *vm_run_dict(struct enclosing *encl,
-                           struct dict_expr *dict_expr) {
-  assert(encl != NULL);
-  struct object *res = vm_alloc(encl->vm, false);
-  res->type = TYPE_DICT;
-  hashmap_init(&res->hashmap, DEFAULT_HM_TOTAL_ROWS, DEFAULT_HM_MAX_OBJECTS);
+val vm_unit_op(struct vm *vm, val right, enum unit_op op) {
+  assert(vm != NULL);
+  assert(right != VAL_NULL);
 
-  struct dict_expr *cur = dict_expr;
-  while (cur != NULL) {
-    struct object *value = vm_run_expr(encl, cur->value);
-    enum hashmap_state state = hashmap_put(&res->hashmap, cur->key, value);
-    assert(state == HM_OK);
-    cur = cur->next;
+  if (op == OP_NEG) {
+    switch (val_type(right)) {
+    case TYPE_U64:
+    case TYPE_I64:
+      return vm_i64(vm, -val_i64(right));
+    case TYPE_F64:
+      return val_from_f64(-val_as_f64(right));
+    default:
+      return vm_error(vm, "unsupported operation for type");
+    }
+  } else if (op == OP_NOT) {
+    switch (val_type(right)) {
+    case TYPE_U64:
+    case TYPE_I64:
+      return val_from_small_i64(!val_i64(right));
+    case TYPE_F64:
+      return val_from_f64(!val_as_f64(right));
+    default:
+      return vm_error(vm, "unsupported operation for type");
+    }
   }
-  return res;
+
+  return vm_error(vm, "unrecognized unitary operation");
 }
 
-struct object *vm_run_for(struct enclosing *encl, struct for_expr *for_expr) {
-  assert(encl != NULL);
-  assert(for_expr != NULL);
-  struct list *res_head = NULL;
-  struct list *res_tail = NULL;
-
-  struct object *iterator_value = vm_run_expr(encl, for_expr->iterator_expr);
-  if (iterator_value->type == TYPE_LIST) {
-    struct list *cur_item = iterator_value->list;
-    while (cur_item != NULL) {
-      struct enclosing forked;
-      enclosing_init(&forked, encl->vm, encl);
-
-      char *item_handle_id =
-          for_expr->handle_expr->id; // only one iterator handler is supported
-      enclosing_bind(&forked, cur_item->item, strdup(item_handle_id));
-
-      struct object *iteration_value =
-          vm_run_expr(&forked, for_expr->iteration_expr);
-
-      if (for_expr->filter_expr != NULL) {
-        enclosing_bind(&forked, iteration_value, strdup("it"));
-        struct object *filter_value =
-            vm_run_expr(&forked, for_expr->filter_expr);
-        if (filter_value->type != TYPE_ERROR &&
-            filter_value->type != TYPE_FUNCTION && filter_value->u64 == 0) {
-          cur_item = cur_item->next;
-          enclosing_free(&forked);
-          continue;
-        }
-      }
+#define vm_load_frame()                                                        \
+  do {                                                                         \
+    frame = &vm->frames[vm->frames_size - 1];                                  \
+    code = frame->callee->function->chunk->code;                               \
+    consts = frame->callee->function->chunk->consts;                           \
+    ip = frame->ip;                                                            \
+  } while (0)
 
-      struct list *new_item = malloc(sizeof(struct list));
-      new_item->next = NULL;
-      new_item->item = iteration_value;
+#define vm_top(n) (vm->stack[vm->stack_size - 1 - (n)])
 
-      if (res_head == NULL) {
-        res_head = new_item;
+val vm_exec(struct vm *vm) {
+  assert(vm != NULL);
+  assert(vm->frames_size > 0);
+
+  // runs until the frame on top at the moment of entering returns
+  size_t stop = vm->frames_size - 1;
+  struct frame *frame;
+  uint32_t *code;
+  uint32_t *ip;
+  val *consts;
+  vm_load_frame();
+
+  for (;;) {
+    switch ((enum opcode)*ip++) {
+    case BC_CONST:
+      vm_push(vm, consts[*ip++]);
+      break;
+    case BC_LOAD: {
+      size_t depth = *ip++;
+      size_t slot = *ip++;
+      if (depth == 0) {
+        vm_push(vm, vm->stack[frame->base + slot]);
+        break;
       }
 
-      if (res_tail != NULL) {
-        res_tail->next = new_item;
+      struct env *env = frame->callee->function->closure;
+      while (--depth > 0) {
+        env = env->parent;
+      }
+      vm_push(vm, env->slots[slot]);
+      break;
+    }
+    case BC_LOAD_GLOBAL:
+      vm_push(vm, vm->globals[*ip++]);
+      break;
+    case BC_STORE:
+      vm->stack[frame->base + *ip++] = vm_pop(vm);
+      break;
+    case BC_INDEX: {
+      val base = vm_pop(vm);
+      val key = vm_pop(vm);
+      vm_push(vm, vm_index(vm, base, key));
+      break;
+    }
+    case BC_BIN: {
+      enum bin_op op = *ip++;
+      val right = vm_pop(vm);
+      val left = vm_pop(vm);
+      vm_push(vm, handle_bin_op(vm, left, right, op));
+      break;
+    }
+    case BC_UNIT: {
+      enum unit_op op = *ip++;
+      val right = vm_pop(vm);
+      vm_push(vm, vm_unit_op(vm, right, op));
+      break;
+    }
+    case BC_CALL:
+      frame->ip = ip + 1;
+      if (vm_enter(vm, *ip++)) {
+        vm_load_frame();
+      }
+      break;
+    case BC_JUMP:
+      ip = code + *ip;
+      break;
+    case BC_JUMP_FALSE: {
+      size_t else_at = *ip++;
+      size_t exit_at = *ip++;
+      val cond = vm_pop(vm);
+      if (cond == VAL_UNIT) {
+        vm_push(vm, vm_error(vm, "cannot evaluate condition for unit type"));
+        ip = code + exit_at;
+      } else if (!val_truthy(cond)) {
+        ip = code + else_at;
+      }
+      break;
+    }
+    case BC_JUMP_FILTER: {
+      size_t skip_at = *ip++;
+      val filter = vm_pop(vm);
+      enum object_type type = val_type(filter);
+      if (type != TYPE_ERROR && type != TYPE_FUNCTION && !val_truthy(filter)) {
+        ip = code + skip_at;
+      }
+      break;
+    }
+    case BC_DUP:
+      vm_push(vm, vm_top(0));
+      break;
+    case BC_POP:
+      vm->stack_size--;
+      break;
+    case BC_LIST: {
+      // items stay on the stack until the list exists so they are traced
+      size_t total = *ip++;
+      if (total == 0) {
+        vm_push(vm, vm->empty_list);
+        break;
       }
 
-      res_tail = new_item;
-      enclosing_free(&forked);
-      cur_item = cur_item->next;
+      struct object *res = vm_alloc(vm, false);
+      vm->stack_size -= total;
+      res->type = TYPE_LIST;
+      res->list.size = total;
+      res->list.items = malloc(sizeof(val) * total);
+      memcpy(res->list.items, vm->stack + vm->stack_size, sizeof(val) * total);
+      vm->gc.allocated += sizeof(val) * total;
+      list_pack(vm, res);
+      vm_push(vm, val_from_obj(res));
+      break;
     }
-  } else if (iterator_value->type == TYPE_FUNCTION) {
-    struct object *state = vm_alloc(encl->vm, false);
-    bool keep_iterating = true;
-    char *item_handle_id =
-        for_expr->handle_expr->id; // only one iterator handler is supported
-
-    while (keep_iterating) {
-      struct list iterator_step_args = {
-          .next = NULL,
-          .item = state,
-      };
-      struct object *iterator_next = vm_run_function(
-          encl, iterator_value->function, NULL, &iterator_step_args);
-      if (iterator_next->type != TYPE_PAIR) {
-        keep_iterating = false;
-      } else {
-        state = iterator_next;
-        struct object *head = state->pair.head;
-        assert(head != NULL);
-        keep_iterating = head->bol;
+    case BC_DICT: {
+      struct object *res = vm_alloc(vm, false);
+      res->type = TYPE_DICT;
+      res->hashmap = malloc(sizeof(struct hashmap));
+      hashmap_init(res->hashmap, DEFAULT_HM_CAP);
+      vm->gc.allocated +=
+          sizeof(struct hashmap) + hashmap_bytes(res->hashmap);
+      vm_push(vm, val_from_obj(res));
+      break;
+    }
+    case BC_DICT_PUT: {
+      struct object *key = val_as_obj(consts[*ip++]);
+      val value = vm_pop(vm);
+      struct object *dict = val_as_obj(vm_top(0));
+      assert(key->interned);
+      size_t bytes = hashmap_bytes(dict->hashmap);
+      enum hashmap_state state = hashmap_put(dict->hashmap, key, value);
+      assert(state == HM_OK);
+      // a grow allocates the new table while the old one is still held
+      if (hashmap_bytes(dict->hashmap) > bytes) {
+        vm->gc.allocated += hashmap_bytes(dict->hashmap) - bytes;
+      }
+      gc_write_barrier(vm, dict, value);
+      break;
+    }
+    case BC_ITER_INIT: {
+      size_t exit_at = *ip++;
+      val iterable = vm_top(0);
+      enum object_type type = val_type(iterable);
+      if (type != TYPE_LIST && type != TYPE_FUNCTION) {
+        vm_top(0) = vm_error(vm, "cannot iterate over type %d", type);
+        ip = code + exit_at;
+        break;
       }
 
-      struct enclosing forked;
-      enclosing_init(&forked, encl->vm, encl);
-      enclosing_bind(&forked, iterator_next->pair.tail, strdup(item_handle_id));
-
-      struct object *iteration_value =
-          vm_run_expr(&forked, for_expr->iteration_expr);
-
-      if (for_expr->filter_expr != NULL) {
-        enclosing_bind(&forked, iteration_value, strdup("it"));
-        struct object *filter_value =
-            vm_run_expr(&forked, for_expr->filter_expr);
-        if (filter_value->type != TYPE_ERROR &&
-            filter_value->type != TYPE_FUNCTION && filter_value->u64 == 0) {
-          enclosing_free(&forked);
-          continue;
-        }
+      vm->stack_size--;
+
+      if (vm->iters_size == vm->iters_cap) {
+        vm->iters_cap *= 2;
+        vm->iters = realloc(vm->iters, sizeof(struct iter) * vm->iters_cap);
       }
 
-      struct list *new_item = malloc(sizeof(struct list));
-      new_item->next = NULL;
-      new_item->item = iteration_value;
+      struct iter *iter = &vm->iters[vm->iters_size++];
+      *iter = (struct iter){
+          .iterable = iterable,
+          .cursor = 0LL,
+          .state = VAL_NULL,
+          .items = NULL,
+          .size = 0LL,
+          .cap = 0LL,
+          .done = false,
+      };
 
-      if (res_head == NULL) {
-        res_head = new_item;
+      if (type != TYPE_LIST) {
+        // iterator functions start from an unit state
+        iter->state = VAL_UNIT;
       }
+      break;
+    }
+    case BC_ITER_NEXT: {
+      size_t done_at = *ip++;
+      struct iter *iter = &vm->iters[vm->iters_size - 1];
+      if (val_type(iter->iterable) == TYPE_LIST) {
+        struct object *list = val_as_obj(iter->iterable);
+        if (iter->cursor == list->list.size) {
+          ip = code + done_at;
+          break;
+        }
 
-      if (res_tail != NULL) {
-        res_tail->next = new_item;
+        val item = list_get(vm, list, iter->cursor++);
+        vm_push(vm, item);
+        break;
       }
 
-      res_tail = new_item;
-      enclosing_free(&forked);
-    }
-  } else {
-    struct object *res = vm_alloc(encl->vm, false);
-    make_errorf(res, "cannot iterate over type %d", iterator_value->type);
-    return res;
-  }
+      if (iter->done) {
+        ip = code + done_at;
+        break;
+      }
 
-  struct object *res = vm_alloc(encl->vm, false);
-  res->type = TYPE_LIST;
-  res->list = res_head;
-  return res;
-}
+      frame->ip = ip;
+      val next = vm_call(vm, iter->iterable, &iter->state, 1);
+      vm_load_frame();
+
+      // the nested call may have moved the iteration stack
+      iter = &vm->iters[vm->iters_size - 1];
+      if (val_type(next) != TYPE_PAIR) {
+        ip = code + done_at;
+        break;
+      }
 
-struct object *vm_run_reduce(struct enclosing *encl,
-                             struct reduce_expr *reduce_expr) {
-  assert(encl != NULL);
-  assert(reduce_expr != NULL);
-  struct for_expr *for_expr = reduce_expr->for_expr;
-  struct object *iterator_value = vm_run_expr(encl, for_expr->iterator_expr);
-  struct object *carry = vm_run_expr(encl, reduce_expr->value);
-
-  if (iterator_value->type == TYPE_LIST) {
-    struct list *cur_item = iterator_value->list;
-    while (cur_item != NULL) {
-      struct enclosing forked;
-      enclosing_init(&forked, encl->vm, encl);
-
-      char *item_handle_id =
-          for_expr->handle_expr->id; // only one iterator handler is supported
-      enclosing_bind(&forked, cur_item->item, strdup(item_handle_id));
-      enclosing_bind(&forked, carry, strdup(reduce_expr->id));
-
-      if (for_expr->filter_expr != NULL) {
-        struct object *filter_value =
-            vm_run_expr(&forked, for_expr->filter_expr);
-        if (filter_value->type != TYPE_ERROR &&
-            filter_value->type != TYPE_FUNCTION && filter_value->u64 == 0) {
-          cur_item = cur_item->next;
-          enclosing_free(&forked);
-          continue;
+      iter->state = next;
+      iter->done = !val_truthy(val_as_obj(next)->pair.head);
+      vm_push(vm, val_as_obj(next)->pair.tail);
+      break;
+    }
+    case BC_ITER_APPEND: {
+      struct iter *iter = &vm->iters[vm->iters_size - 1];
+      if (iter->size == iter->cap) {
+        // mapping a list yields at most one item per item of the source
+        if (iter->cap == 0 && val_type(iter->iterable) == TYPE_LIST) {
+          iter->cap = val_as_obj(iter->iterable)->list.size;
+        } else if (iter->cap == 0) {
+          iter->cap = DEFAULT_VM_ITER_ITEMS_CAP;
+        } else {
+          iter->cap *= 2;
         }
+        iter->items = realloc(iter->items, sizeof(val) * iter->cap);
       }
 
-      carry = vm_run_expr(&forked, for_expr->iteration_expr);
-      enclosing_free(&forked);
-      cur_item = cur_item->next;
+      iter->items[iter->size++] = vm_pop(vm);
+      break;
     }
-  } else if (iterator_value->type == TYPE_FUNCTION) {
-    bool keep_iterating = true;
-    char *item_handle_id =
-        for_expr->handle_expr->id; // only one iterator handler is supported
-
-    while (keep_iterating) {
-      struct list iterator_step_args = {
-          .next = NULL,
-          .item = carry,
-      };
-      struct object *iterator_next = vm_run_function(
-          encl, iterator_value->function, NULL, &iterator_step_args);
-      if (iterator_next->type != TYPE_PAIR) {
-        keep_iterating = false;
-      } else {
-        carry = iterator_next;
-        struct object *head = carry->pair.head;
-        assert(head != NULL);
-        keep_iterating = head->bol;
+    case BC_ITER_END: {
+      // comprehensions filtering everything out share the empty list
+      if (vm->iters[vm->iters_size - 1].size == 0) {
+        vm->iters_size--;
+        vm_push(vm, vm->empty_list);
+        break;
       }
 
-      struct enclosing forked;
-      enclosing_init(&forked, encl->vm, encl);
-      enclosing_bind(&forked, iterator_next->pair.tail, strdup(item_handle_id));
-
-      struct object *iteration_value =
-          vm_run_expr(&forked, for_expr->iteration_expr);
-
-      if (for_expr->filter_expr != NULL) {
-        enclosing_bind(&forked, iteration_value, strdup("it"));
-        struct object *filter_value =
-            vm_run_expr(&forked, for_expr->filter_expr);
-        if (filter_value->type != TYPE_ERROR &&
-            filter_value->type != TYPE_FUNCTION && filter_value->u64 == 0) {
-          enclosing_free(&forked);
-          continue;
+      struct object *res = vm_alloc(vm, false);
+      struct iter *iter = &vm->iters[--vm->iters_size];
+      res->type = TYPE_LIST;
+      res->list.size = iter->size;
+      res->list.items = iter->size < iter->cap
+                            ? realloc(iter->items, sizeof(val) * iter->size)
+                            : iter->items;
+      vm->gc.allocated += sizeof(val) * iter->size;
+      list_pack(vm, res);
+      vm_push(vm, val_from_obj(res));
+      break;
+    }
+    case BC_ITER_DROP:
+      free(vm->iters[--vm->iters_size].items);
+      break;
+    case BC_ITER_REDUCE: {
+      enum reduce_op op = *ip++;
+      size_t exit_at = *ip++;
+      struct iter *iter = &vm->iters[vm->iters_size - 1];
+      val res = VAL_NULL;
+      if (val_type(iter->iterable) == TYPE_LIST &&
+          list_reduce(vm, op, val_as_obj(iter->iterable), vm_top(0), &res)) {
+        vm->iters_size--;
+        vm_top(0) = res;
+        ip = code + exit_at;
+      }
+      break;
+    }
+    case BC_LAMBDA: {
+      struct object *template = val_as_obj(consts[*ip++]);
+      size_t captured = *ip++;
+      struct object *object = vm_alloc(vm, false);
+      object->type = TYPE_FUNCTION;
+      object->function = malloc(sizeof(struct function));
+      *object->function = *template->function;
+      object->function->closure = env_capture(
+          frame->callee->function->closure, vm->stack + frame->base, captured);
+      vm->gc.allocated += sizeof(struct function) + env_bytes(captured);
+
+      // the whole chain counts since parents are shared by sibling closures
+      for (struct env *env = object->function->closure; env != NULL;
+           env = env->parent) {
+        for (size_t si = 0LL; si < env->size; si++) {
+          gc_write_barrier(vm, object, env->slots[si]);
         }
       }
+      vm_push(vm, val_from_obj(object));
+      break;
     }
-  } else {
-    struct object *res = vm_alloc(encl->vm, false);
-    make_errorf(res, "cannot iterate over type %d", iterator_value->type);
-    return res;
-  }
-
-  return carry;
-}
-
-struct object *vm_run_lambda(struct enclosing *encl,
-                             struct lambda_expr *lambda_expr) {
-  assert(encl != NULL);
-  assert(lambda_expr != NULL);
-
-  struct enclosing *closure = malloc(sizeof(struct enclosing));
-  enclosing_init(closure, encl->vm, &encl->vm->globals);
-  enclosing_capture(closure, encl);
-
-  struct object *object = vm_alloc(encl->vm, false);
-  object->type = TYPE_FUNCTION;
-  object->function = (struct function){
-      .target = TARGET_SCRIPT,
-      .native_call = NULL,
-      .closure = closure,
-      .params = lambda_expr->params,
-      .body = lambda_expr->body,
-      .id = NULL,
-  };
-
-  return object;
-}
-
-struct object *vm_run_expr(struct enclosing *encl, struct expr *expr) {
-  assert(encl != NULL);
-  assert(expr != NULL);
+    case BC_RETURN: {
+      val res = vm_pop(vm);
+      assert(vm->stack_size ==
+             frame->base + frame->callee->function->chunk->nslots);
+      vm->stack_size = frame->base - 1;
+      vm->frames_size--;
+
+      if (vm->frames_size == stop) {
+        return res;
+      }
 
-  struct object *res = NULL;
-  switch (expr->type) {
-  case EXPR_LIT:
-    res = vm_run_lit(encl, expr->lit_expr);
-    break;
-  case EXPR_LOOKUP:
-    res = vm_run_lookup(encl, expr->lookup_expr);
-    break;
-  case EXPR_BIN:
-    res = vm_run_bin(encl, expr->bin_expr);
-    break;
-  case EXPR_UNIT:
-    res = vm_run_unit(encl, expr->unit_expr);
-    break;
-  case EXPR_LET:
-    res = vm_run_let(encl, expr->let_expr);
-    break;
-  case EXPR_CALL:
-    res = vm_run_call(encl, expr->call_expr);
-    break;
-  case EXPR_IF:
-    res = vm_run_if(encl, expr->if_expr);
-    break;
-  case EXPR_LIST:
-    res = vm_run_list(encl, expr->list_expr);
-    break;
-  case EXPR_DICT:
-    res = vm_run_dict(encl, expr->dict_expr);
-    break;
-  case EXPR_FOR:
-    res = vm_run_for(encl, expr->for_expr);
-    break;
-  case EXPR_REDUCE:
-    res = vm_run_reduce(encl, expr->reduce_expr);
-    break;
-  case EXPR_LAMBDA:
-    res = vm_run_lambda(encl, expr->lambda_expr);
-    break;
-  case EXPR_DEF:
-    res = vm_run_def(encl->vm, expr->def_expr);
-    break;
+      vm_push(vm, res);
+      vm_load_frame();
+      break;
+    }
+    }
   }
-
-  return res;
 }
@@ -1,37 +1,65 @@
 #pragma once
 #include "ast.h"
+#include "bytecode.h"
+#include "gc.h"
 #include "hashmap.h"
+#include "heap.h"
+#include "num.h"
+#include "str.h"
+#include "value.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <time.h>
 
 struct vm;
 struct object;
-struct enclosing;
+struct env;
 struct pair {
-  struct object *head;
-  struct object *tail;
+  val head;
+  val tail;
 };
 
+// Items sit in one array allocated to the exact size, the empty list has none.
+// Lists of numbers all of one type keep them unboxed, they are turned back
+// into values only when read.
+enum list_kind { LIST_VALUES = 0, LIST_I64, LIST_U64, LIST_F64 };
 struct list {
-  struct list *next;
-  struct object *item;
+  union {
+    val *items;
+    int64_t *i64s;
+    uint64_t *u64s;
+    double *f64s;
+  };
+  size_t size;
+};
+
+// Strings joined by + past a size are kept as the two halves until their
+// chars are needed, so building one piece by piece copies each piece once.
+struct rope {
+  val left;
+  val right;
+  size_t size;
 };
 
-typedef struct object *(*native_fun)(struct enclosing *);
+typedef val (*native_fun)(struct vm *, val *, size_t);
 
 enum function_target { TARGET_SCRIPT, TARGET_NATIVE };
 struct function {
   native_fun native_call;
   struct def_params *params;
-  struct enclosing *closure;
-  struct expr *body;
+  struct env *closure;
+  struct chunk *chunk;
   char *id;
   enum function_target target;
 };
 
-enum gc_flag { GC_UNMARKED = 0, GC_MARKED, GC_ROOT };
+// Marks are kept in the page bitmaps, flags only tell how a cell is owned.
+enum gc_flag {
+  GC_UNMARKED = 0,
+  GC_ROOT,
+  GC_FREE,
+  GC_FORWARDED
+};
 enum object_type {
   TYPE_UNIT,
   TYPE_NIL,
@@ -47,101 +75,232 @@ enum object_type {
   TYPE_FUNCTION,
 };
 
+// Payloads fit in three words so every cell takes half a cache line, the
+// bodies of functions and dicts are allocated on their own and owned by it.
+// The header is packed into bytes so short strings fit in the payload.
+#define OBJECT_SMALL_CHARS 24
+#define OBJECT_LARGE_STRING 0xff
+#define OBJECT_ROPE_STRING 0xfe
 struct object {
-  struct object *gc_next;
   union {
-    uint8_t bol;
+    struct object *free_next;
+    struct object *forward;
     uint64_t u64;
     int64_t i64;
-    double f64;
     char *error;
-    char *string;
-    struct list *list;
+    struct string *string;
+    struct list list;
     struct pair pair;
-    struct function function;
-    struct hashmap hashmap;
+    struct rope rope;
+    struct function *function;
+    struct hashmap *hashmap;
+    char small[OBJECT_SMALL_CHARS];
   };
-  enum object_type type;
-  enum gc_flag flag;
+  enum object_type type : 8;
+  enum gc_flag flag : 8;
+  bool remembered;
+  enum list_kind list_kind : 8;
+  uint8_t small_size;
+  bool interned;
 };
 
-struct bind {
-  struct bind *next;
-  struct object *object;
-  char *id;
+_Static_assert(sizeof(struct object) == 32, "objects must fit 32 byte cells");
+
+// Slots captured by a closure, parent are the slots captured by the function
+// that created it, so a (depth, slot) address walks depth - 1 parents.
+struct env {
+  struct env *parent;
+  size_t refs;
+  size_t size;
+  val slots[];
 };
 
-struct enclosing {
-  struct vm *vm;
-  struct enclosing *parent;
-  struct bind *head;
-  struct bind *tail;
+#define env_bytes(size) (sizeof(struct env) + sizeof(val) * (size))
+
+// Slots of a frame live in the vm stack starting at base, the first ones are
+// the arguments pushed by the caller right above the callee.
+struct frame {
+  struct object *callee;
+  uint32_t *ip;
+  size_t base;
+};
+
+// Items appended by a comprehension grow in place and are handed over to the
+// list built at the end.
+struct iter {
+  val iterable;
+  size_t cursor;
+  val state;
+  val *items;
+  size_t size;
+  size_t cap;
+  bool done;
+};
+
+// Strings made once per distinct chars and never collected, so equal
+// symbols are the same object. Identifiers, string literals and dict keys
+// are symbols, slots are found by open addressing on the chars hash.
+struct symbol {
+  uint64_t hash;
+  struct object *string;
 };
 
 struct vm {
-  struct object *heap_head;
-  struct object *heap_tail;
-  struct enclosing globals;
+  struct heap heap;
+  struct gc gc;
+  val *globals;
+  struct object **global_ids;
+  size_t globals_size;
+  size_t globals_cap;
   struct def_exprs *source_exprs;
-  struct timespec last_gc;
+  struct chunk *chunks;
+  val *stack;
+  size_t stack_size;
+  size_t stack_cap;
+  struct frame *frames;
+  size_t frames_size;
+  size_t frames_cap;
+  struct iter *iters;
+  size_t iters_size;
+  size_t iters_cap;
+  struct symbol *symbols;
+  size_t symbols_size;
+  size_t symbols_cap;
+  // immortal roots handed out instead of allocating equal immutable objects
+  val empty_list;
+  val type_names[TYPE_FUNCTION + 1];
 };
 
 void vm_init(struct vm *vm);
 void vm_free(struct vm *vm);
 
-size_t vm_mark_all(struct vm *vm);
-size_t vm_sweep(struct vm *vm);
-size_t vm_gc(struct vm *vm);
-
 struct object *vm_alloc(struct vm *vm, bool is_root);
+val vm_box_i64(struct vm *vm, int64_t i64);
+val vm_box_u64(struct vm *vm, uint64_t u64);
+val vm_error(struct vm *vm, const char *format, ...);
+size_t object_size(struct object *obj);
 size_t object_free(struct object *obj);
-size_t object_mark(struct object *obj);
-size_t object_print(struct object *value, bool debug);
+size_t val_print(val value, bool debug);
+void str_fill(struct vm *vm, struct object *obj, const char *left,
+              size_t left_size, const char *right, size_t right_size);
+void str_rope(struct vm *vm, struct object *obj, val left, val right);
+const char *str_flatten(struct object *obj);
+uint64_t str_hash(struct object *obj);
+bool str_equals(struct object *left, struct object *right);
+struct object *symbol_intern(struct vm *vm, const char *chars, size_t size);
+struct object *symbol_lookup(struct vm *vm, const char *chars, size_t size,
+                             uint64_t hash);
+struct object *symbol_find(struct vm *vm, struct object *string);
+struct symbol *symbol_probe(struct vm *vm, const char *chars, size_t size,
+                            uint64_t hash);
+void symbol_grow(struct vm *vm);
+size_t i64_print(int64_t i64, bool debug);
+size_t u64_print(uint64_t u64, bool debug);
+size_t f64_print(double f64, bool debug);
+size_t num_print(const char *type, const char *chars, size_t size,
+                 bool debug);
+void list_pack(struct vm *vm, struct object *obj);
+val list_get(struct vm *vm, struct object *obj, size_t index);
 
-void enclosing_init(struct enclosing *e, struct vm *vm,
-                    struct enclosing *parent);
-void enclosing_free(struct enclosing *e);
-void enclosing_bind(struct enclosing *e, struct object *object, char *id);
-void enclosing_capture(struct enclosing *into, struct enclosing *from);
-struct bind *enclosing_find(struct enclosing *e, char *id);
+struct env *env_capture(struct env *parent, val *slots, size_t size);
+void env_release(struct env *env);
+size_t vm_define_global(struct vm *vm, char *id, val value);
+bool vm_find_global(struct vm *vm, char *id, size_t *index_out);
 
 void vm_define_all(struct vm *vm, struct def_exprs *defs);
-struct object *vm_run_main(struct vm *vm);
-struct object *vm_run_function(struct enclosing *encl, struct function function,
-                               struct call_args *expr_args,
-                               struct list *value_args);
-struct object *vm_run_def(struct vm *vm, struct def_expr *def);
-
-struct object *vm_run_lit(struct enclosing *encl, struct lit_expr *lit_expr);
-struct object *vm_run_lookup(struct enclosing *encl,
-                             struct lookup_expr *lookup_expr);
-struct object *vm_run_bin(struct enclosing *encl, struct bin_expr *bin_expr);
-struct object *vm_run_unit(struct enclosing *encl, struct unit_expr *unit_expr);
-struct object *vm_run_let(struct enclosing *encl, struct let_expr *let_expr);
-struct object *vm_run_call(struct enclosing *encl, struct call_expr *call_expr);
-struct object *vm_run_if(struct enclosing *encl, struct if_expr *if_expr);
-struct object *vm_run_list(struct enclosing *encl, struct list_expr *list_expr);
-struct object *vm_run_dict(struct enclosing *encl, struct dict_expr *dict_expr);
-struct object *vm_run_for(struct enclosing *encl, struct for_expr *for_expr);
-struct object *vm_run_reduce(struct enclosing *encl,
-                             struct reduce_expr *reduce_expr);
-struct object *vm_run_lambda(struct enclosing *encl,
-                             struct lambda_expr *lambda_expr);
-struct object *vm_run_expr(struct enclosing *encl, struct expr *expr);
-
-#define DEFAULT_GC_INTERVAL_NS 100000
-#define make_error(res, msg)                                                   \
-  do {                                                                         \
-    res->type = TYPE_ERROR;                                                    \
-    res->error = malloc(sizeof(char) * 200);                                   \
-    memset(res->error, 0L, sizeof(char) * 200);                                \
-    sprintf(res->error, "%s", msg);                                            \
-  } while (0);
-
-#define make_errorf(res, msg, ...)                                             \
-  do {                                                                         \
-    res->type = TYPE_ERROR;                                                    \
-    res->error = malloc(sizeof(char) * 200);                                   \
-    memset(res->error, 0L, sizeof(char) * 200);                                \
-    sprintf(res->error, msg, __VA_ARGS__);                                     \
-  } while (0);
+val vm_run_main(struct vm *vm);
+bool vm_enter(struct vm *vm, size_t argc);
+val vm_call(struct vm *vm, val callee, val *argv, size_t argc);
+val vm_exec(struct vm *vm);
+void vm_push(struct vm *vm, val value);
+val vm_pop(struct vm *vm);
+
+val vm_index(struct vm *vm, val base, val key);
+val vm_unit_op(struct vm *vm, val right, enum unit_op op);
+bool val_truthy(val value);
+
+static inline enum object_type val_type(val value) {
+  if (val_is_f64(value)) {
+    return TYPE_F64;
+  }
+
+  switch (value & VAL_TAG_MASK) {
+  case VAL_TAG_I64:
+    return TYPE_I64;
+  case VAL_TAG_U64:
+    return TYPE_U64;
+  }
+
+  switch (value) {
+  case VAL_NIL:
+    return TYPE_NIL;
+  case VAL_UNIT:
+    return TYPE_UNIT;
+  case VAL_FALSE:
+  case VAL_TRUE:
+    return TYPE_BOL;
+  }
+
+  return val_as_obj(value)->type;
+}
+
+// Integers of either signedness read as the other one, like the u64 and i64
+// fields of an object sharing their bits.
+static inline int64_t val_i64(val value) {
+  if ((value & VAL_TAG_MASK) == VAL_TAG_I64) {
+    return (int64_t)(value << (64 - VAL_INT_BITS)) >> (64 - VAL_INT_BITS);
+  }
+
+  if ((value & VAL_TAG_MASK) == VAL_TAG_U64) {
+    return (int64_t)(value & VAL_U64_MAX);
+  }
+
+  return val_as_obj(value)->i64;
+}
+
+#define val_u64(value) ((uint64_t)val_i64(value))
+
+// Strings up to OBJECT_SMALL_CHARS - 1 chars are kept NUL terminated in the
+// cell, so their chars move with a young cell on any allocation. Ropes are
+// flattened the first time their chars are asked for.
+static inline const char *str_chars(struct object *obj) {
+  switch (obj->small_size) {
+  case OBJECT_LARGE_STRING:
+    return obj->string->chars;
+  case OBJECT_ROPE_STRING:
+    return str_flatten(obj);
+  }
+
+  return obj->small;
+}
+
+static inline size_t str_size(struct object *obj) {
+  switch (obj->small_size) {
+  case OBJECT_LARGE_STRING:
+    return obj->string->size;
+  case OBJECT_ROPE_STRING:
+    return obj->rope.size;
+  }
+
+  return obj->small_size;
+}
+
+// Only integers out of the 48 bit range allocate.
+static inline val vm_i64(struct vm *vm, int64_t i64) {
+  return val_fits_i64(i64) ? val_from_small_i64(i64) : vm_box_i64(vm, i64);
+}
+
+static inline val vm_u64(struct vm *vm, uint64_t u64) {
+  return val_fits_u64(u64) ? val_from_small_u64(u64) : vm_box_u64(vm, u64);
+}
+
+#define DEFAULT_VM_STACK_CAP 256
+#define DEFAULT_VM_FRAMES_CAP 64
+#define DEFAULT_VM_ITERS_CAP 8
+#define DEFAULT_VM_ITER_ITEMS_CAP 8
+#define DEFAULT_VM_GLOBALS_CAP 32
+#define DEFAULT_VM_SYMBOLS_CAP 64
+#define DEFAULT_STR_ROPE_MIN 64
+#define DEFAULT_STR_FLATTEN_CAP 16
+// error messages are cut to this many chars, terminator included
+#define DEFAULT_VM_ERROR_SIZE 200